@@ -17,9 +17,30 @@
  *
  */
 
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Bands of the map are composited, and tiles written, on a pool of threads
+// where pthreads are available, and one after another everywhere else
+#ifndef _WIN32
+#define USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 // Standard types
 typedef unsigned char byte;
 typedef unsigned short uint16;
@@ -79,50 +100,113 @@ uint32 getFileSize(FILE *file) {
 	return size;
 }
 
-void writeBMPHeader(FILE *output, uint16 width, uint16 height, uint16 bitsPerPixel) {
-	// Main Header
-	writeUint16BE(output, 'BM');
-	writeUint32LE(output, 0); // Size, will fill in later
-	writeUint16LE(output, 0); // Reserved
-	writeUint16LE(output, 0); // Reserved
-	writeUint32LE(output, 0); // Image offset, will fill in later
+uint16 READ_LE_UINT16(const byte *data) {
+	return (*(data + 1) << 8) | *data;
+}
 
-	// Info Header
-	writeUint32LE(output, 40);
-	writeUint32LE(output, width);
-	writeUint32LE(output, height);
-	writeUint16LE(output, 1);
-	writeUint16LE(output, bitsPerPixel);
-	writeUint32LE(output, 0);
-	writeUint32LE(output, 0); // Image size, will fill in later
-	writeUint32LE(output, 72); // 72 dpi sounds fine to me
-	writeUint32LE(output, 72); // as above
+void WRITE_LE_UINT16(byte *data, uint16 x) {
+	data[0] = x & 0xff;
+	data[1] = x >> 8;
+}
+
+void WRITE_LE_UINT32(byte *data, uint32 x) {
+	WRITE_LE_UINT16(data, x & 0xffff);
+	WRITE_LE_UINT16(data + 2, x >> 16);
+}
+
+// Read up to length bytes from offset in the input and return how many
+// there were. With threads, this is a positional read that leaves the
+// descriptor's offset alone, so any number of threads can read from the
+// one descriptor at once.
+uint32 readData(FILE *input, unsigned long long offset, byte *data, uint32 length) {
+#ifdef USE_THREADS
+	uint32 total = 0;
+
+	while (total < length) {
+		ssize_t count = pread(fileno(input), data + total, length - total, offset + total);
+		if (count <= 0)
+			break;
+
+		total += count;
+	}
+
+	return total;
+#else
+	fseek(input, offset, SEEK_SET);
+	return fread(data, 1, length, input);
+#endif
+}
 
-	// Only write the empty palette if we're not in paletted mode. The
-	// palette header will be written in writeBMPPalette() otherwise.
-	if (bitsPerPixel > 8) {
-		writeUint32LE(output, 0);
-		writeUint32LE(output, 0);
+// Write length bytes at offset in the output, positionally with threads as
+// above. Nothing else may write to the output through stdio meanwhile.
+bool writeData(FILE *output, unsigned long long offset, const byte *data, uint32 length) {
+#ifdef USE_THREADS
+	while (length > 0) {
+		ssize_t count = pwrite(fileno(output), data, length, offset);
+		if (count <= 0)
+			return false;
+
+		data += count;
+		offset += count;
+		length -= count;
 	}
+
+	return true;
+#else
+	fseek(output, offset, SEEK_SET);
+	return fwrite(data, 1, length, output) == length;
+#endif
 }
 
-void fillBMPHeaderValues(FILE *output, uint32 imageOffset, uint32 imageSize) {
-	fflush(output);
-	uint32 fileSize = getFileSize(output);
+// Constants
+enum {
+	kBMPHeaderSize = 54,
+	kBMPCompressionRGB = 0,
+	kBMPCompressionBitfields = 3,
+	kBMPBitfieldsHeaderSize = 66, // Headers plus the three color masks
+	kBGMHeaderSize = 16, // The pixels follow it
+	kBandSize = 1024 * 1024, // Source bytes converted at a time
+	kTileSize = 256 // Width and height of Deep Zoom tiles
+};
+
+uint32 getBMPPitch(uint32 width, uint16 bitsPerPixel) {
+	return (width * (bitsPerPixel >> 3) + 3) & ~3;
+}
+
+// Build the BMP headers in memory for imageSize bytes of pixel data and
+// return the offset of that data
+uint32 writeBMPHeader(byte *data, uint32 width, uint32 height, uint16 bitsPerPixel, uint32 compression, uint32 imageSize) {
+	uint32 imageOffset = (compression == kBMPCompressionBitfields) ? kBMPBitfieldsHeaderSize : kBMPHeaderSize;
 
-	fseek(output, 2, SEEK_SET);
-	fflush(output);
-	writeUint32LE(output, fileSize);
-	fflush(output);
+	// Main Header
+	data[0] = 'B';
+	data[1] = 'M';
+	WRITE_LE_UINT32(data + 2, imageOffset + imageSize);
+	WRITE_LE_UINT32(data + 6, 0); // Reserved
+	WRITE_LE_UINT32(data + 10, imageOffset);
 
-	fseek(output, 10, SEEK_SET);
-	fflush(output);
-	writeUint32LE(output, imageOffset);
-	fflush(output);
+	// Info Header
+	WRITE_LE_UINT32(data + 14, 40);
+	WRITE_LE_UINT32(data + 18, width);
+	WRITE_LE_UINT32(data + 22, height);
+	WRITE_LE_UINT16(data + 26, 1);
+	WRITE_LE_UINT16(data + 28, bitsPerPixel);
+	WRITE_LE_UINT32(data + 30, compression);
+	WRITE_LE_UINT32(data + 34, imageSize);
+	WRITE_LE_UINT32(data + 38, 72); // 72 dpi sounds fine to me
+	WRITE_LE_UINT32(data + 42, 72); // as above
+	WRITE_LE_UINT32(data + 46, 0);
+	WRITE_LE_UINT32(data + 50, 0);
+
+	// BI_BITFIELDS images are always rgb555 here; the masks follow the
+	// info header
+	if (compression == kBMPCompressionBitfields) {
+		WRITE_LE_UINT32(data + 54, 0x7c00);
+		WRITE_LE_UINT32(data + 58, 0x03e0);
+		WRITE_LE_UINT32(data + 62, 0x001f);
+	}
 
-	fseek(output, 34, SEEK_SET);
-	fflush(output);
-	writeUint32LE(output, imageSize);
+	return imageOffset;
 }
 
 // Functions to isolate the color channels and blow them up to 8-bit values
@@ -140,8 +224,33 @@ inline byte isolateBlueChannel(uint16 color) {
 }
 
 
-// NOTE: Original format is rgb555
-bool extractImageToBMP(FILE *input, FILE *output) {
+// Convert one row of rgb555 pixels to a BMP row, either expanded to 24bpp
+// or kept as it is for 16bpp, and pad it out to pitch bytes
+void convertRow(const byte *src, byte *dst, uint32 width, uint32 pitch, bool keepRGB555) {
+	uint32 rowSize = width * (keepRGB555 ? 2 : 3);
+
+	if (keepRGB555) {
+		memcpy(dst, src, rowSize);
+	} else {
+		for (uint32 x = 0; x < width; x++) {
+			uint16 color = READ_LE_UINT16(src + x * 2);
+			dst[x * 3] = isolateBlueChannel(color);
+			dst[x * 3 + 1] = isolateGreenChannel(color);
+			dst[x * 3 + 2] = isolateRedChannel(color);
+		}
+	}
+
+	memset(dst + rowSize, 0, pitch - rowSize);
+}
+
+struct BGMHeader {
+	uint32 length;
+	uint32 width;
+	uint32 height;
+};
+
+// Read and check the header; the pixels follow it
+bool readBGMHeader(FILE *input, BGMHeader &header) {
 	uint32 tag = readUint32BE(input);
 
 	if (tag != 'MAPI' && tag != 0) {
@@ -149,75 +258,715 @@ bool extractImageToBMP(FILE *input, FILE *output) {
 		return false;
 	}
 
-	uint32 length = readUint32LE(input);
-	uint32 width = readUint32LE(input);
-	uint32 height = readUint32LE(input);
+	header.length = readUint32LE(input);
+	header.width = readUint32LE(input);
+	header.height = readUint32LE(input);
+
+	printf("Width = %d\n", header.width);
+	printf("Height = %d\n", header.height);
 
-	printf("Width = %d\n", width);
-	printf("Height = %d\n", height);
+	if (header.width == 0 || header.height == 0) {
+		printf("Image is empty\n");
+		return false;
+	}
 
-	if (width * height * 2 != length) {
-		printf("Image entry has bad length %08x\n", length);
+	// Multiply in 64 bits so huge dimensions can't wrap around to a
+	// matching length
+	if ((unsigned long long)header.width * header.height * 2 != header.length) {
+		printf("Image entry has bad length %08x\n", header.length);
 		return false;
 	}
 
-	uint16 *pixels = new uint16[width * height];
-	for (uint32 i = 0; i < width * height; i++)
-		pixels[i] = readUint16LE(input);
+	return true;
+}
+
+// Get how many rows of the given width fit in one band
+uint32 getBandRows(uint32 width, uint32 height) {
+	uint32 rows = kBandSize / (width * 2);
+
+	if (rows == 0)
+		rows = 1;
+	if (rows > height)
+		rows = height;
+
+	return rows;
+}
+
+// Draw count overlay pixels over the base pixels, except where the overlay
+// has the key color. The unused top bit is ignored.
+void compositePixels(byte *base, const byte *overlay, uint32 count, uint16 key) {
+	uint32 i = 0;
+
+#ifdef __SSE2__
+	const __m128i colorMask = _mm_set1_epi16(0x7fff);
+	const __m128i keyColor = _mm_set1_epi16(key);
+
+	for (; i + 8 <= count; i += 8) {
+		__m128i dst = _mm_loadu_si128((const __m128i *)(base + i * 2));
+		__m128i src = _mm_loadu_si128((const __m128i *)(overlay + i * 2));
+		__m128i transparent = _mm_cmpeq_epi16(_mm_and_si128(src, colorMask), keyColor);
+		dst = _mm_or_si128(_mm_and_si128(transparent, dst), _mm_andnot_si128(transparent, src));
+		_mm_storeu_si128((__m128i *)(base + i * 2), dst);
+	}
+#endif
+
+	for (; i < count; i++) {
+		uint16 color = READ_LE_UINT16(overlay + i * 2);
+		if ((color & 0x7fff) != key)
+			WRITE_LE_UINT16(base + i * 2, color);
+	}
+}
+
+// Read the map's header and check any overlays are the same size
+bool readMapHeaders(FILE *input, FILE **overlays, uint32 overlayCount, BGMHeader &header) {
+	if (!readBGMHeader(input, header))
+		return false;
+
+	for (uint32 i = 0; i < overlayCount; i++) {
+		BGMHeader overlayHeader;
+		if (!readBGMHeader(overlays[i], overlayHeader))
+			return false;
+
+		if (overlayHeader.width != header.width || overlayHeader.height != header.height) {
+			printf("Overlay %d is %dx%d, not %dx%d\n", i + 1, overlayHeader.width, overlayHeader.height, header.width, header.height);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+uint32 getThreadCount(uint32 jobCount) {
+	uint32 threadCount = 1;
+
+#ifdef USE_THREADS
+	long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpuCount > 1)
+		threadCount = cpuCount;
+#endif
+
+	return (threadCount < jobCount) ? threadCount : (jobCount ? jobCount : 1);
+}
+
+// Run the worker on jobCount jobs' worth of threads and wait for them all.
+// This thread works through the jobs alongside the extra ones.
+void runWorkers(void *(*worker)(void *), void *context, uint32 jobCount) {
+#ifdef USE_THREADS
+	uint32 extraThreads = getThreadCount(jobCount) - 1;
+	pthread_t *threads = new pthread_t[extraThreads + 1];
+	uint32 started = 0;
+
+	for (; started < extraThreads; started++)
+		if (pthread_create(&threads[started], 0, worker, context) != 0)
+			break;
+
+	worker(context);
+
+	for (uint32 i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
 
-	writeBMPHeader(output, width, height, 24);
+	delete[] threads;
+#else
+	(void)jobCount;
+	worker(context);
+#endif
+}
+
+// A run of bands of the map to composite and convert. Every band has a
+// fixed place to go, either in the BMP file or in the rows buffer, so they
+// are handed out to the workers in any order and need no lock once taken.
+struct BandJobs {
+	FILE *input; ///< Only ever read with readData()
+	FILE **overlays; ///< As above
+	uint32 overlayCount;
+	uint16 key;
+	uint32 width;
+	uint32 height;
+	uint32 bandRows;
+	uint32 nextBand;
+	uint32 endBand; ///< One past the last band of the run
+	bool keepRGB555;
+	uint32 pitch;
+	FILE *output; ///< Written with writeData(), or 0 to fill rows instead
+	uint32 imageOffset; ///< Of the pixels in output
+	byte *rows; ///< Top-down rows of the run, when there's no output
+	uint32 firstRow; ///< The map row that rows starts at
+	uint32 failedBand; ///< The first band that couldn't be written
+	bool failed;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+// Once a band has failed, no more bands are handed out
+bool takeBand(BandJobs &jobs, uint32 &band) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&jobs.lock);
+#endif
+
+	band = jobs.nextBand;
+	bool found = !jobs.failed && band < jobs.endBand;
+	if (found)
+		jobs.nextBand++;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&jobs.lock);
+#endif
+
+	return found;
+}
+
+void stopBands(BandJobs &jobs, uint32 band) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&jobs.lock);
+#endif
+
+	if (!jobs.failed || band < jobs.failedBand)
+		jobs.failedBand = band;
+	jobs.failed = true;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&jobs.lock);
+#endif
+}
+
+// Read size bytes of the map from offset into band and draw the overlays
+// over them. overlay is scratch space of the same size.
+void readBand(const BandJobs &jobs, uint32 offset, byte *band, byte *overlay, uint32 size) {
+	uint32 count = readData(jobs.input, kBGMHeaderSize + (unsigned long long)offset, band, size);
+	memset(band + count, 0, size - count);
 
-	const uint32 pitch = width * 3;
-	const int extraDataLength = (pitch % 4) ? 4 - (pitch % 4) : 0;
+	for (uint32 i = 0; i < jobs.overlayCount; i++) {
+		// Anything missing from a short overlay is left transparent
+		count = readData(jobs.overlays[i], kBGMHeaderSize + (unsigned long long)offset, overlay, size) & ~1;
+		compositePixels(band, overlay, count / 2, jobs.key);
+	}
+}
 
-	for (int y = height - 1; y >= 0; y--) {
-		for (int x = 0; x < width; x++) {
-			uint16 color = pixels[x + width * y];
-			writeByte(output, isolateBlueChannel(color));
-			writeByte(output, isolateGreenChannel(color));
-			writeByte(output, isolateRedChannel(color));
+// Keep compositing bands until the run is done. Each worker reads and
+// converts into its own scratch buffers.
+void *bandWorker(void *arg) {
+	BandJobs &jobs = *(BandJobs *)arg;
+	uint32 bandSize = jobs.bandRows * jobs.width * 2;
+	byte *src = new byte[bandSize];
+	byte *overlay = jobs.overlayCount ? new byte[bandSize] : 0;
+	byte *dst = jobs.output ? new byte[jobs.bandRows * jobs.pitch] : 0;
+	uint32 band;
+
+	while (takeBand(jobs, band)) {
+		uint32 y = band * jobs.bandRows;
+		uint32 rows = (jobs.height - y < jobs.bandRows) ? jobs.height - y : jobs.bandRows;
+		readBand(jobs, y * jobs.width * 2, src, overlay, rows * jobs.width * 2);
+
+		if (!jobs.output) {
+			for (uint32 row = 0; row < rows; row++)
+				convertRow(src + row * jobs.width * 2, jobs.rows + (y - jobs.firstRow + row) * jobs.pitch, jobs.width, jobs.pitch, jobs.keepRGB555);
+
+			continue;
 		}
 
-		for (int i = 0; i < extraDataLength; i++)
-			writeByte(output, 0);
+		// A band's rows sit next to each other, in reverse, in a bottom-up BMP
+		for (uint32 row = 0; row < rows; row++)
+			convertRow(src + row * jobs.width * 2, dst + (rows - 1 - row) * jobs.pitch, jobs.width, jobs.pitch, jobs.keepRGB555);
+
+		if (!writeData(jobs.output, jobs.imageOffset + (unsigned long long)(jobs.height - y - rows) * jobs.pitch, dst, rows * jobs.pitch))
+			stopBands(jobs, band);
+	}
+
+	delete[] src;
+	delete[] overlay;
+	delete[] dst;
+	return 0;
+}
+
+// Composite and convert bands up to endBand, starting from the next one
+bool convertBands(BandJobs &jobs, uint32 endBand) {
+	jobs.endBand = endBand;
+
+#ifdef USE_THREADS
+	pthread_mutex_init(&jobs.lock, 0);
+#endif
+
+	runWorkers(bandWorker, &jobs, jobs.endBand - jobs.nextBand);
+
+#ifdef USE_THREADS
+	pthread_mutex_destroy(&jobs.lock);
+#endif
+
+	return !jobs.failed;
+}
+
+void initBandJobs(BandJobs &jobs, FILE *input, FILE **overlays, uint32 overlayCount, uint16 key, const BGMHeader &header, bool keepRGB555) {
+	jobs.input = input;
+	jobs.overlays = overlays;
+	jobs.overlayCount = overlayCount;
+	jobs.key = key;
+	jobs.width = header.width;
+	jobs.height = header.height;
+	jobs.bandRows = getBandRows(header.width, header.height);
+	jobs.nextBand = 0;
+	jobs.endBand = 0;
+	jobs.keepRGB555 = keepRGB555;
+	jobs.pitch = getBMPPitch(header.width, keepRGB555 ? 16 : 24);
+	jobs.output = 0;
+	jobs.imageOffset = 0;
+	jobs.rows = 0;
+	jobs.firstRow = 0;
+	jobs.failedBand = 0;
+	jobs.failed = false;
+}
+
+// NOTE: Original format is rgb555
+// The map is converted one band of rows at a time, so memory use stays at
+// a couple of bands per thread whatever the map size. Each band is written
+// straight to its final place in the file. Any overlays (OVMs the size of
+// the map) are read band by band alongside it and drawn over it in order.
+bool extractImageToBMP(FILE *input, FILE *output, bool keepRGB555, FILE **overlays, uint32 overlayCount, uint16 key) {
+	BGMHeader header;
+	if (!readMapHeaders(input, overlays, overlayCount, header))
+		return false;
+
+	BandJobs jobs;
+	initBandJobs(jobs, input, overlays, overlayCount, key, header, keepRGB555);
+
+	byte bmpHeader[kBMPBitfieldsHeaderSize];
+	jobs.output = output;
+	jobs.imageOffset = writeBMPHeader(bmpHeader, header.width, header.height, keepRGB555 ? 16 : 24,
+			keepRGB555 ? kBMPCompressionBitfields : kBMPCompressionRGB, jobs.pitch * header.height);
+
+	if (!writeData(output, 0, bmpHeader, jobs.imageOffset)) {
+		printf("Failed to write the BMP header\n");
+		return false;
+	}
+
+	if (!convertBands(jobs, (header.height + jobs.bandRows - 1) / jobs.bandRows)) {
+		uint32 y = jobs.failedBand * jobs.bandRows;
+		uint32 rows = (header.height - y < jobs.bandRows) ? header.height - y : jobs.bandRows;
+		printf("Failed to write rows %d-%d\n", y, y + rows - 1);
+		return false;
+	}
+
+	return true;
+}
+
+// Deep Zoom pyramids
+//
+// Level 0 is 1x1 and each level is twice the size of the one before it, up
+// to the full map at the top. Each level is cut into 256x256 tiles (smaller
+// at the right and bottom edges), saved as
+// <name>_files/<level>/<column>_<row>.bmp, and <name>.dzi describes the
+// whole image.
+//
+// The map is read from top to bottom once. Each level only holds the strip
+// of 256 rows it is currently filling. Every two rows a level receives are
+// averaged into one row of the level below, and every completed strip is
+// written out as a row of tiles.
+
+struct PyramidLevel {
+	uint32 width;
+	uint32 height;
+	uint32 rowCount; // Rows received so far
+	byte *strip; // Up to kTileSize rows of 24bpp pixels
+	byte *halfRow; // Scratch for the row passed to the level below
+};
+
+struct Pyramid {
+	const char *name;
+	char *path; // Scratch for directory names
+	PyramidLevel *levels;
+	uint32 levelCount;
+};
+
+bool makeDirectory(const char *path) {
+#ifdef _WIN32
+	return _mkdir(path) == 0 || errno == EEXIST;
+#else
+	return mkdir(path, 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// Average each 2x2 block of two 24bpp rows into one pixel. At an odd right
+// edge the last column pairs with itself; passing the same row twice does
+// the same for an odd bottom edge.
+void downsampleRows(const byte *top, const byte *bottom, uint32 width, byte *dst) {
+	uint32 halfWidth = (width + 1) / 2;
+	uint32 x = 0;
+
+#ifdef __SSE2__
+	// Two output pixels from every 12 bytes of the rows. The loads take 16
+	// bytes, so stop while there are still 4 more to read; the scalar loop
+	// below finishes the row, odd edge included.
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rounding = _mm_set1_epi16(2);
+
+	for (; x * 6 + 16 <= width * 3; x += 2) {
+		__m128i topPixels = _mm_loadu_si128((const __m128i *)(top + x * 6));
+		__m128i bottomPixels = _mm_loadu_si128((const __m128i *)(bottom + x * 6));
+
+		// Widen each pair of source pixels (bytes 0-5 and 6-11) to 16 bits
+		// and add the two rows together
+		__m128i first = _mm_add_epi16(_mm_unpacklo_epi8(topPixels, zero), _mm_unpacklo_epi8(bottomPixels, zero));
+		__m128i second = _mm_add_epi16(_mm_unpacklo_epi8(_mm_srli_si128(topPixels, 6), zero),
+				_mm_unpacklo_epi8(_mm_srli_si128(bottomPixels, 6), zero));
+
+		// Then add the right pixel of each pair to the left one
+		first = _mm_add_epi16(first, _mm_srli_si128(first, 6));
+		second = _mm_add_epi16(second, _mm_srli_si128(second, 6));
+
+		// The sums are in words 0-2 of each half
+		__m128i sum = _mm_unpacklo_epi64(first, second);
+		__m128i average = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+		__m128i packed = _mm_packus_epi16(average, average);
+
+		uint32 left = _mm_cvtsi128_si32(packed);
+		uint32 right = _mm_cvtsi128_si32(_mm_srli_si128(packed, 4));
+		dst[x * 3] = left;
+		dst[x * 3 + 1] = left >> 8;
+		dst[x * 3 + 2] = left >> 16;
+		dst[x * 3 + 3] = right;
+		dst[x * 3 + 4] = right >> 8;
+		dst[x * 3 + 5] = right >> 16;
+	}
+#endif
+
+	for (; x < halfWidth; x++) {
+		uint32 left = x * 6;
+		uint32 right = (x * 2 + 1 < width) ? left + 3 : left;
+
+		for (uint32 c = 0; c < 3; c++)
+			dst[x * 3 + c] = (top[left + c] + top[right + c] + bottom[left + c] + bottom[right + c] + 2) >> 2;
+	}
+}
+
+// Write one tile of a completed strip of a level. The tile and path buffers
+// are the caller's scratch space.
+bool writeTile(const Pyramid &pyramid, uint32 level, uint32 column, uint32 tileRow, byte *tile, char *path) {
+	const PyramidLevel &current = pyramid.levels[level];
+	uint32 x = column * kTileSize;
+	uint32 y = tileRow * kTileSize;
+	uint32 tileWidth = (current.width - x < kTileSize) ? current.width - x : (uint32)kTileSize;
+	uint32 tileHeight = (current.height - y < kTileSize) ? current.height - y : (uint32)kTileSize;
+	uint32 pitch = getBMPPitch(tileWidth, 24);
+	uint32 imageOffset = writeBMPHeader(tile, tileWidth, tileHeight, 24, kBMPCompressionRGB, pitch * tileHeight);
+
+	for (uint32 row = 0; row < tileHeight; row++) {
+		byte *dst = tile + imageOffset + (tileHeight - 1 - row) * pitch;
+		memcpy(dst, current.strip + (row * current.width + x) * 3, tileWidth * 3);
+		memset(dst + tileWidth * 3, 0, pitch - tileWidth * 3);
+	}
+
+	sprintf(path, "%s_files/%d/%d_%d.bmp", pyramid.name, level, column, tileRow);
+
+	FILE *output = fopen(path, "wb");
+	if (!output) {
+		printf("Could not open '%s' for writing\n", path);
+		return false;
+	}
+
+	uint32 size = imageOffset + pitch * tileHeight;
+	bool written = fwrite(tile, 1, size, output) == size;
+	fclose(output);
+
+	if (!written) {
+		printf("Failed to write '%s'\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+// The tiles of a strip don't depend on each other, so they're handed out
+// to the workers a column at a time
+struct TileJobs {
+	const Pyramid *pyramid;
+	uint32 level;
+	uint32 tileRow;
+	uint32 columnCount;
+	uint32 nextColumn;
+	bool failed;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+// Once a tile has failed, no more columns are handed out
+bool takeColumn(TileJobs &jobs, uint32 &column) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&jobs.lock);
+#endif
+
+	column = jobs.nextColumn;
+	bool found = !jobs.failed && column < jobs.columnCount;
+	if (found)
+		jobs.nextColumn++;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&jobs.lock);
+#endif
+
+	return found;
+}
+
+void stopJobs(TileJobs &jobs) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&jobs.lock);
+#endif
+
+	jobs.failed = true;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&jobs.lock);
+#endif
+}
+
+// Keep writing tiles until the strip is done. The strip is only read, and
+// each worker encodes into its own tile buffer.
+void *tileWorker(void *arg) {
+	TileJobs &jobs = *(TileJobs *)arg;
+	byte *tile = new byte[kBMPHeaderSize + getBMPPitch(kTileSize, 24) * kTileSize];
+	char *path = new char[strlen(jobs.pyramid->name) + 48];
+	uint32 column;
+
+	while (takeColumn(jobs, column))
+		if (!writeTile(*jobs.pyramid, jobs.level, column, jobs.tileRow, tile, path))
+			stopJobs(jobs);
+
+	delete[] path;
+	delete[] tile;
+	return 0;
+}
+
+// Write the tiles of one completed strip of a level. This thread works
+// through the columns alongside the extra ones.
+bool writeTiles(const Pyramid &pyramid, uint32 level, uint32 tileRow) {
+	TileJobs jobs;
+	jobs.pyramid = &pyramid;
+	jobs.level = level;
+	jobs.tileRow = tileRow;
+	jobs.columnCount = (pyramid.levels[level].width + kTileSize - 1) / kTileSize;
+	jobs.nextColumn = 0;
+	jobs.failed = false;
+
+#ifdef USE_THREADS
+	pthread_mutex_init(&jobs.lock, 0);
+#endif
+
+	runWorkers(tileWorker, &jobs, jobs.columnCount);
+
+#ifdef USE_THREADS
+	pthread_mutex_destroy(&jobs.lock);
+#endif
+
+	return !jobs.failed;
+}
+
+// Add the next row to a level, passing rows down the pyramid and writing
+// tiles as strips are completed
+bool addPyramidRow(Pyramid &pyramid, uint32 level, const byte *row) {
+	PyramidLevel &current = pyramid.levels[level];
+	uint32 y = current.rowCount++;
+	byte *stripRow = current.strip + (y % kTileSize) * current.width * 3;
+	memcpy(stripRow, row, current.width * 3);
+
+	// Every pair of rows, or a lone last row, makes a row of the level below
+	if (level > 0 && (y % 2 == 1 || y == current.height - 1)) {
+		const byte *top = (y % 2 == 1) ? stripRow - current.width * 3 : stripRow;
+		downsampleRows(top, stripRow, current.width, current.halfRow);
+
+		if (!addPyramidRow(pyramid, level - 1, current.halfRow))
+			return false;
+	}
+
+	if (y % kTileSize == kTileSize - 1 || y == current.height - 1)
+		return writeTiles(pyramid, level, y / kTileSize);
+
+	return true;
+}
+
+bool writeDZI(const char *name, uint32 width, uint32 height) {
+	char *filename = new char[strlen(name) + 5];
+	strcpy(filename, name);
+	strcat(filename, ".dzi");
+
+	FILE *output = fopen(filename, "w");
+	if (!output) {
+		printf("Could not open '%s' for writing\n", filename);
+		delete[] filename;
+		return false;
 	}
 
-	fillBMPHeaderValues(output, 54, (pitch + extraDataLength) * height);
+	fprintf(output, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	fprintf(output, "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"bmp\" Overlap=\"0\" TileSize=\"%d\">\n", kTileSize);
+	fprintf(output, "\t<Size Width=\"%d\" Height=\"%d\"/>\n", width, height);
+	fprintf(output, "</Image>\n");
 
-	delete[] pixels;
+	fclose(output);
+	delete[] filename;
 	return true;
 }
 
+// NOTE: Original format is rgb555
+bool convertMapToTiles(FILE *input, const char *name, FILE **overlays, uint32 overlayCount, uint16 key) {
+	BGMHeader header;
+	if (!readMapHeaders(input, overlays, overlayCount, header))
+		return false;
+
+	uint32 width = header.width;
+	uint32 height = header.height;
+	uint32 largest = (width > height) ? width : height;
+
+	Pyramid pyramid;
+	pyramid.name = name;
+	pyramid.path = new char[strlen(name) + 48];
+	pyramid.levelCount = 1;
+
+	while ((1u << (pyramid.levelCount - 1)) < largest)
+		pyramid.levelCount++;
+
+	sprintf(pyramid.path, "%s_files", name);
+	if (!makeDirectory(pyramid.path)) {
+		printf("Could not create '%s'\n", pyramid.path);
+		delete[] pyramid.path;
+		return false;
+	}
+
+	// Size the levels from the top down, halving (rounded up) each time
+	pyramid.levels = new PyramidLevel[pyramid.levelCount];
+
+	for (int level = pyramid.levelCount - 1; level >= 0; level--) {
+		PyramidLevel &current = pyramid.levels[level];
+		current.width = ((uint32)level == pyramid.levelCount - 1) ? width : (pyramid.levels[level + 1].width + 1) / 2;
+		current.height = ((uint32)level == pyramid.levelCount - 1) ? height : (pyramid.levels[level + 1].height + 1) / 2;
+		current.rowCount = 0;
+		current.strip = new byte[current.width * 3 * ((current.height < kTileSize) ? current.height : (uint32)kTileSize)];
+		current.halfRow = new byte[(current.width + 1) / 2 * 3];
+
+		sprintf(pyramid.path, "%s_files/%d", name, level);
+		makeDirectory(pyramid.path);
+	}
+
+	bool success = writeDZI(name, width, height);
+
+	// The pyramid takes the rows in order, so the bands are composited a
+	// batch at a time, one per thread, and then fed to it
+	BandJobs jobs;
+	initBandJobs(jobs, input, overlays, overlayCount, key, header, false);
+
+	uint32 bandCount = (height + jobs.bandRows - 1) / jobs.bandRows;
+	uint32 batchBands = getThreadCount(bandCount);
+	jobs.rows = new byte[batchBands * jobs.bandRows * jobs.pitch];
+
+	for (uint32 band = 0; band < bandCount && success; band += batchBands) {
+		uint32 endBand = (bandCount - band < batchBands) ? bandCount : band + batchBands;
+		uint32 endRow = (endBand * jobs.bandRows < height) ? endBand * jobs.bandRows : height;
+		jobs.firstRow = band * jobs.bandRows;
+		convertBands(jobs, endBand);
+
+		for (uint32 y = jobs.firstRow; y < endRow && success; y++)
+			success = addPyramidRow(pyramid, pyramid.levelCount - 1, jobs.rows + (y - jobs.firstRow) * jobs.pitch);
+	}
+
+	if (success)
+		printf("Wrote %d levels of tiles\n", pyramid.levelCount);
+
+	for (uint32 level = 0; level < pyramid.levelCount; level++) {
+		delete[] pyramid.levels[level].strip;
+		delete[] pyramid.levels[level].halfRow;
+	}
+
+	delete[] pyramid.levels;
+	delete[] pyramid.path;
+	delete[] jobs.rows;
+	return success;
+}
+
 int main(int argc, const char **argv) {
 	printf("\nCC4/CC5 BGM/OVM Image Converter\n");
 	printf("Converts CC4/CC5 BGM/OVM images to BMP\n");
 	printf("Written by Matthew Hoops (clone2727)\n");
 	printf("See license.txt for the license\n\n");
 
-	if (argc < 3) {
-		printf("Usage: %s <input> <output>\n", argv[0]);
+	bool keepRGB555 = false;
+	bool makeTiles = false;
+	const char **overlayNames = new const char *[argc];
+	uint32 overlayCount = 0;
+	uint16 key = 0;
+
+	int argIndex = 1;
+	for (; argIndex < argc && !strncmp(argv[argIndex], "--", 2); argIndex++) {
+		if (!strcmp(argv[argIndex], "--16bpp")) {
+			keepRGB555 = true;
+		} else if (!strcmp(argv[argIndex], "--tiles")) {
+			makeTiles = true;
+		} else if (!strcmp(argv[argIndex], "--overlay") && argIndex + 1 < argc) {
+			overlayNames[overlayCount++] = argv[++argIndex];
+		} else if (!strcmp(argv[argIndex], "--key") && argIndex + 1 < argc) {
+			key = strtoul(argv[++argIndex], 0, 0) & 0x7fff;
+		} else {
+			printf("Unknown option '%s'\n", argv[argIndex]);
+			return 1;
+		}
+	}
+
+	// Tiles are always 24bpp
+	if (makeTiles && keepRGB555) {
+		printf("--16bpp cannot be used with --tiles\n");
+		return 1;
+	}
+
+	if (argc - argIndex < 2) {
+		printf("Usage: %s [--16bpp] [--overlay <ovm>]... [--key <color>] <input> <output>\n", argv[0]);
+		printf("       %s --tiles [--overlay <ovm>]... [--key <color>] <input> <name>\n", argv[0]);
+		printf("  --16bpp    Keep the rgb555 pixels in a 16bpp BMP instead of 24bpp\n");
+		printf("  --tiles    Write a Deep Zoom pyramid of 256x256 BMP tiles to <name>_files\n");
+		printf("             and <name>.dzi instead of one BMP\n");
+		printf("  --overlay  Draw an OVM over the map; may be given more than once\n");
+		printf("  --key      The rgb555 color that is transparent in overlays (default 0)\n");
 		return 0;
 	}
 
-	FILE *input = fopen(argv[1], "rb");
+	FILE **overlays = new FILE *[argc];
+	for (uint32 i = 0; i < overlayCount; i++) {
+		overlays[i] = fopen(overlayNames[i], "rb");
+		if (!overlays[i]) {
+			printf("Could not open '%s' for reading\n", overlayNames[i]);
+			return 1;
+		}
+	}
+
+	FILE *input = fopen(argv[argIndex], "rb");
 	if (!input) {
-		printf("Could not open '%s' for reading\n", argv[1]);
+		printf("Could not open '%s' for reading\n", argv[argIndex]);
 		return 1;
 	}
 
-	FILE *output = fopen(argv[2], "wb+");
-	if (!output) {
-		printf("Could not open '%s' for writing\n", argv[2]);
-		fclose(input);
-		return 1;
+	bool success;
+
+	if (makeTiles) {
+		success = convertMapToTiles(input, argv[argIndex + 1], overlays, overlayCount, key);
+	} else {
+		FILE *output = fopen(argv[argIndex + 1], "wb");
+		if (!output) {
+			printf("Could not open '%s' for writing\n", argv[argIndex + 1]);
+			fclose(input);
+			return 1;
+		}
+
+		success = extractImageToBMP(input, output, keepRGB555, overlays, overlayCount, key);
+		fflush(output);
+		fclose(output);
 	}
 
-	if (!extractImageToBMP(input, output))
+	if (!success)
 		return 1;
 
+	for (uint32 i = 0; i < overlayCount; i++)
+		fclose(overlays[i]);
+
+	delete[] overlays;
+	delete[] overlayNames;
+
 	fclose(input);
-	fflush(output);
-	fclose(output);
 
 	printf("\nAll Done!\n");
 	return 0;
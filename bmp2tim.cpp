@@ -0,0 +1,610 @@
+/* bmp2tim.cpp -- Convert BMP's to PlayStation TIM images
+ * Copyright (c) 2012 Matthew Hoops (clone2727)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+// Thanks to http://www.romhacking.net/docs/timgfx.txt for the format information
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Standard types
+typedef unsigned char byte;
+typedef unsigned short uint16;
+typedef signed short int16;
+typedef unsigned int uint32;
+
+// Constants
+enum {
+	kColorCount = 0x8000, // Every 15-bit color
+	kMaxWidth = 4096, // 1024 VRAM words of 4bpp pixels
+	kMaxHeight = 512, // VRAM height
+	kTransparentColor = 0x0000,
+	kSTPBit = 0x8000
+};
+
+// Helper functions for reading integers from the stream (maintaining endianness)
+byte readByte(FILE *file) {
+	byte b = 0;
+	fread(&b, 1, 1, file);
+	return b;
+}
+
+uint16 readUint16LE(FILE *file) {
+	uint16 x = readByte(file);
+	return x | readByte(file) << 8;
+}
+
+uint32 readUint32LE(FILE *file) {
+	uint16 x = readUint16LE(file);
+	return x | readUint16LE(file) << 16;
+}
+
+uint16 readUint16BE(FILE *file) {
+	uint16 x = readByte(file) << 8;
+	return x | readByte(file);
+}
+
+void writeByte(FILE *file, byte b) {
+	fwrite(&b, 1, 1, file);
+}
+
+void writeUint16LE(FILE *file, uint16 x) {
+	writeByte(file, x & 0xff);
+	writeByte(file, x >> 8);
+}
+
+void writeUint32LE(FILE *file, uint32 x) {
+	writeUint16LE(file, x & 0xffff);
+	writeUint16LE(file, x >> 16);
+}
+
+// Pack 8-bit channels into 15-bit BGR, the order the PlayStation uses
+inline uint16 packColor(byte r, byte g, byte b) {
+	return (r >> 3) | ((g >> 3) << 5) | ((b >> 3) << 10);
+}
+
+inline byte isolateRedChannel(uint16 color) {
+	return color & 0x1f;
+}
+
+inline byte isolateGreenChannel(uint16 color) {
+	return (color >> 5) & 0x1f;
+}
+
+inline byte isolateBlueChannel(uint16 color) {
+	return (color >> 10) & 0x1f;
+}
+
+// A pixel that's fully black is drawn transparent by the GPU, so opaque
+// black has to have the STP bit set to still be drawn.
+inline uint16 makeTIMColor(uint16 color, bool transparent) {
+	if (transparent)
+		return kTransparentColor;
+
+	return (color == 0) ? kSTPBit : color;
+}
+
+struct Image {
+	Image() { colors = 0; transparent = 0; width = height = 0; }
+	~Image() { delete[] colors; delete[] transparent; }
+
+	uint32 width, height;
+	uint16 *colors;    ///< 15-bit colors, top-down
+	byte *transparent; ///< Non-zero where the source alpha was < 128
+};
+
+// Load an uncompressed 24-bit or 32-bit BMP into 15-bit colors
+bool loadBMP(FILE *input, Image &image) {
+	if (readUint16BE(input) != 'BM') {
+		printf("BM tag not found\n");
+		return false;
+	}
+
+	readUint32LE(input); // File size
+	readUint32LE(input); // Reserved
+	uint32 imageOffset = readUint32LE(input);
+	uint32 headerSize = readUint32LE(input);
+	int width = (int)readUint32LE(input);
+	int height = (int)readUint32LE(input);
+	readUint16LE(input); // Planes
+	uint16 bitsPerPixel = readUint16LE(input);
+	uint32 compression = readUint32LE(input);
+
+	if (headerSize < 40) {
+		printf("Unsupported BMP header size %d\n", headerSize);
+		return false;
+	}
+
+	if (bitsPerPixel != 24 && bitsPerPixel != 32) {
+		printf("Unsupported BMP depth %d, use a 24-bit or 32-bit BMP\n", bitsPerPixel);
+		return false;
+	}
+
+	if (compression != 0 && !(compression == 3 && bitsPerPixel == 32)) {
+		printf("Compressed BMPs are not supported\n");
+		return false;
+	}
+
+	// The channel masks follow the 40-byte info header, either as part of
+	// a newer header or on their own for BI_BITFIELDS. Only the newer
+	// headers have room for an alpha mask.
+	uint32 masks[4] = { 0, 0, 0, 0 };
+	uint32 maskCount = (headerSize >= 56) ? 4 : (headerSize >= 52 || compression == 3) ? 3 : 0;
+
+	fseek(input, 54, SEEK_SET);
+	for (uint32 i = 0; i < maskCount; i++)
+		masks[i] = readUint32LE(input);
+
+	if (compression == 3 && (masks[0] != 0xff0000 || masks[1] != 0xff00 || masks[2] != 0xff || (masks[3] != 0 && masks[3] != 0xff000000))) {
+		printf("Unsupported BI_BITFIELDS layout, only BGRA is supported\n");
+		return false;
+	}
+
+	// Most 32-bit BMPs are really XRGB with the fourth byte left at 0, so
+	// it's only taken as alpha if the header says so or some pixel uses it
+	bool alphaDeclared = bitsPerPixel == 32 && masks[3] == 0xff000000;
+	bool alphaUsed = false;
+
+	// Negative height means top-down
+	bool topDown = height < 0;
+	if (topDown)
+		height = -height;
+
+	// Nothing bigger fits in VRAM, and it keeps the pixel count well
+	// away from overflowing
+	if (width <= 0 || height == 0 || width > kMaxWidth || height > kMaxHeight) {
+		printf("Bad BMP dimensions %dx%d, a TIM can be at most %dx%d\n", width, height, kMaxWidth, kMaxHeight);
+		return false;
+	}
+
+	const uint32 pixelCount = width * height;
+
+	image.width = width;
+	image.height = height;
+	image.colors = new uint16[pixelCount];
+	image.transparent = new byte[pixelCount];
+	memset(image.transparent, 0, pixelCount);
+
+	const uint32 bytesPerPixel = bitsPerPixel / 8;
+	const uint32 pitch = width * bytesPerPixel;
+	const uint32 stride = (pitch + 3) & ~3;
+	byte *row = new byte[stride];
+
+	fseek(input, imageOffset, SEEK_SET);
+
+	for (int y = 0; y < height; y++) {
+		if (fread(row, 1, stride, input) != stride) {
+			printf("Failed to read BMP row %d\n", y);
+			delete[] row;
+			return false;
+		}
+
+		uint32 dstY = topDown ? y : height - 1 - y;
+		uint16 *colors = image.colors + dstY * width;
+		byte *transparent = image.transparent + dstY * width;
+
+		for (int x = 0; x < width; x++) {
+			const byte *pixel = row + x * bytesPerPixel;
+			colors[x] = packColor(pixel[2], pixel[1], pixel[0]);
+
+			if (bytesPerPixel == 4) {
+				transparent[x] = pixel[3] < 128;
+
+				if (pixel[3] != 0)
+					alphaUsed = true;
+			}
+		}
+	}
+
+	delete[] row;
+
+	if (!alphaDeclared && !alphaUsed)
+		memset(image.transparent, 0, pixelCount);
+
+	return true;
+}
+
+// A box of the 15-bit color cube, for median cut
+struct ColorBox {
+	byte min[3], max[3];
+	uint32 pixelCount;
+};
+
+// Shrink the box to the colors actually used within it and count its pixels
+void shrinkColorBox(ColorBox &box, const uint32 *histogram) {
+	byte newMin[3] = { 31, 31, 31 }, newMax[3] = { 0, 0, 0 };
+	box.pixelCount = 0;
+
+	for (uint32 b = box.min[2]; b <= box.max[2]; b++) {
+		for (uint32 g = box.min[1]; g <= box.max[1]; g++) {
+			for (uint32 r = box.min[0]; r <= box.max[0]; r++) {
+				uint32 count = histogram[r | (g << 5) | (b << 10)];
+				if (!count)
+					continue;
+
+				box.pixelCount += count;
+				byte c[3] = { (byte)r, (byte)g, (byte)b };
+
+				for (int i = 0; i < 3; i++) {
+					if (c[i] < newMin[i])
+						newMin[i] = c[i];
+					if (c[i] > newMax[i])
+						newMax[i] = c[i];
+				}
+			}
+		}
+	}
+
+	if (box.pixelCount) {
+		memcpy(box.min, newMin, 3);
+		memcpy(box.max, newMax, 3);
+	}
+}
+
+// Split the box at the pixel median of its longest axis. Returns false if
+// the box can't be split any further.
+bool splitColorBox(ColorBox &box, ColorBox &newBox, const uint32 *histogram) {
+	int axis = 0;
+	for (int i = 1; i < 3; i++)
+		if (box.max[i] - box.min[i] > box.max[axis] - box.min[axis])
+			axis = i;
+
+	if (box.max[axis] == box.min[axis])
+		return false;
+
+	// Count the pixels in each slice along the axis
+	uint32 slices[32];
+	memset(slices, 0, sizeof(slices));
+
+	for (uint32 b = box.min[2]; b <= box.max[2]; b++) {
+		for (uint32 g = box.min[1]; g <= box.max[1]; g++) {
+			for (uint32 r = box.min[0]; r <= box.max[0]; r++) {
+				uint32 c[3] = { r, g, b };
+				slices[c[axis]] += histogram[r | (g << 5) | (b << 10)];
+			}
+		}
+	}
+
+	uint32 half = box.pixelCount / 2, count = 0;
+	uint32 split = box.min[axis];
+
+	for (; split < box.max[axis]; split++) {
+		count += slices[split];
+		if (count >= half)
+			break;
+	}
+
+	if (split == box.max[axis])
+		split--;
+
+	newBox = box;
+	box.max[axis] = split;
+	newBox.min[axis] = split + 1;
+
+	shrinkColorBox(box, histogram);
+	shrinkColorBox(newBox, histogram);
+	return true;
+}
+
+// Build a palette of at most maxColors entries for the histogram by median
+// cut: keep splitting the box holding the most pixels. Works on the 32x32x32
+// cube rather than on the pixels, so its cost doesn't depend on image size.
+uint32 buildPalette(const uint32 *histogram, uint16 *palette, uint32 maxColors) {
+	ColorBox *boxes = new ColorBox[maxColors];
+	uint32 boxCount = 1;
+
+	memset(boxes[0].min, 0, 3);
+	memset(boxes[0].max, 31, 3);
+	shrinkColorBox(boxes[0], histogram);
+
+	if (boxes[0].pixelCount == 0) {
+		delete[] boxes;
+		return 0;
+	}
+
+	while (boxCount < maxColors) {
+		// Find the most populated box that can still be split
+		int best = -1;
+		for (uint32 i = 0; i < boxCount; i++) {
+			bool splittable = memcmp(boxes[i].min, boxes[i].max, 3) != 0;
+			if (splittable && (best < 0 || boxes[i].pixelCount > boxes[best].pixelCount))
+				best = i;
+		}
+
+		if (best < 0 || !splitColorBox(boxes[best], boxes[boxCount], histogram))
+			break;
+
+		boxCount++;
+	}
+
+	// Each palette entry is the pixel weighted average of its box
+	for (uint32 i = 0; i < boxCount; i++) {
+		uint32 sum[3] = { 0, 0, 0 }, total = 0;
+
+		for (uint32 b = boxes[i].min[2]; b <= boxes[i].max[2]; b++) {
+			for (uint32 g = boxes[i].min[1]; g <= boxes[i].max[1]; g++) {
+				for (uint32 r = boxes[i].min[0]; r <= boxes[i].max[0]; r++) {
+					uint32 count = histogram[r | (g << 5) | (b << 10)];
+					sum[0] += r * count;
+					sum[1] += g * count;
+					sum[2] += b * count;
+					total += count;
+				}
+			}
+		}
+
+		palette[i] = ((sum[0] + total / 2) / total) | (((sum[1] + total / 2) / total) << 5) | (((sum[2] + total / 2) / total) << 10);
+	}
+
+	delete[] boxes;
+	return boxCount;
+}
+
+// Find the palette entry closest to one color. Ties go to the lowest
+// index. The channels are 5-bit, so every squared distance fits in 16 bits
+// and the SSE2 loop compares 8 palette entries at a time. Each lane keeps
+// its own best entry, and the lanes are merged at the end.
+byte findNearestColor(const int16 (*channels)[256], uint32 paletteSize, uint16 color) {
+	int r = isolateRedChannel(color);
+	int g = isolateGreenChannel(color);
+	int b = isolateBlueChannel(color);
+	uint32 bestDistance = 0xffffffff;
+	uint32 bestIndex = 0;
+	uint32 i = 0;
+
+#ifdef __SSE2__
+	if (paletteSize >= 8) {
+		const __m128i red = _mm_set1_epi16(r);
+		const __m128i green = _mm_set1_epi16(g);
+		const __m128i blue = _mm_set1_epi16(b);
+		const __m128i step = _mm_set1_epi16(8);
+		__m128i index = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+		__m128i laneDistance = _mm_set1_epi16(0x7fff);
+		__m128i laneIndex = _mm_setzero_si128();
+
+		for (; i + 8 <= paletteSize; i += 8) {
+			__m128i dr = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(channels[0] + i)), red);
+			__m128i dg = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(channels[1] + i)), green);
+			__m128i db = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(channels[2] + i)), blue);
+			__m128i distance = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(dr, dr), _mm_mullo_epi16(dg, dg)), _mm_mullo_epi16(db, db));
+
+			// Only a strictly closer entry replaces a lane's best, so
+			// each lane keeps its lowest index on a tie
+			__m128i closer = _mm_cmplt_epi16(distance, laneDistance);
+			laneDistance = _mm_or_si128(_mm_and_si128(closer, distance), _mm_andnot_si128(closer, laneDistance));
+			laneIndex = _mm_or_si128(_mm_and_si128(closer, index), _mm_andnot_si128(closer, laneIndex));
+			index = _mm_add_epi16(index, step);
+		}
+
+		int16 distances[8], indices[8];
+		_mm_storeu_si128((__m128i *)distances, laneDistance);
+		_mm_storeu_si128((__m128i *)indices, laneIndex);
+
+		for (int lane = 0; lane < 8; lane++) {
+			uint32 distance = distances[lane];
+
+			if (distance < bestDistance || (distance == bestDistance && (uint32)indices[lane] < bestIndex)) {
+				bestDistance = distance;
+				bestIndex = indices[lane];
+			}
+		}
+	}
+#endif
+
+	for (; i < paletteSize; i++) {
+		int dr = r - channels[0][i], dg = g - channels[1][i], db = b - channels[2][i];
+		uint32 distance = dr * dr + dg * dg + db * db;
+
+		if (distance < bestDistance) {
+			bestDistance = distance;
+			bestIndex = i;
+		}
+	}
+
+	return bestIndex;
+}
+
+// Find the closest palette entry to every color that's used. This is done
+// once per distinct 15-bit color, not once per pixel.
+void buildColorMap(const uint32 *histogram, const uint16 *palette, uint32 paletteSize, byte *colorMap) {
+	// One array per channel, so 8 entries load at once
+	int16 channels[3][256];
+	for (uint32 i = 0; i < paletteSize; i++) {
+		channels[0][i] = isolateRedChannel(palette[i]);
+		channels[1][i] = isolateGreenChannel(palette[i]);
+		channels[2][i] = isolateBlueChannel(palette[i]);
+	}
+
+	for (uint32 color = 0; color < kColorCount; color++)
+		if (histogram[color])
+			colorMap[color] = findNearestColor(channels, paletteSize, color);
+}
+
+void writeTIMBlockHeader(FILE *output, uint32 dataSize, uint16 x, uint16 y, uint16 width, uint16 height) {
+	writeUint32LE(output, dataSize + 12);
+	writeUint16LE(output, x);
+	writeUint16LE(output, y);
+	writeUint16LE(output, width);
+	writeUint16LE(output, height);
+}
+
+// 4bpp/8bpp, paletted
+bool writeTIMPaletted(FILE *output, Image &image, uint16 bitsPerPixel, uint16 origX, uint16 origY, uint16 palOrigX, uint16 palOrigY) {
+	const uint32 paletteSize = 1 << bitsPerPixel;
+	const uint32 pixelsPerWord = 16 / bitsPerPixel;
+
+	if (image.width % pixelsPerWord) {
+		printf("Width must be a multiple of %d for %dbpp\n", pixelsPerWord, bitsPerPixel);
+		return false;
+	}
+
+	// Histogram the opaque pixels. Transparent pixels get a palette
+	// entry of their own.
+	bool hasTransparency = false;
+	uint32 *histogram = new uint32[kColorCount];
+	memset(histogram, 0, kColorCount * sizeof(uint32));
+
+	for (uint32 i = 0; i < image.width * image.height; i++) {
+		if (image.transparent[i])
+			hasTransparency = true;
+		else
+			histogram[image.colors[i]]++;
+	}
+
+	uint16 palette[256];
+	memset(palette, 0, sizeof(palette));
+
+	uint32 firstColor = hasTransparency ? 1 : 0;
+	uint32 colorCount = buildPalette(histogram, palette + firstColor, paletteSize - firstColor);
+
+	printf("Using %d palette entries\n", colorCount + firstColor);
+
+	byte *colorMap = new byte[kColorCount];
+	memset(colorMap, 0, kColorCount);
+	buildColorMap(histogram, palette + firstColor, colorCount, colorMap);
+
+	// CLUT
+	writeUint32LE(output, 0x10);
+	writeUint32LE(output, (bitsPerPixel == 4) ? 8 : 9);
+	writeTIMBlockHeader(output, paletteSize * 2, palOrigX, palOrigY, paletteSize, 1);
+
+	for (uint32 i = 0; i < paletteSize; i++) {
+		if (hasTransparency && i == 0)
+			writeUint16LE(output, kTransparentColor);
+		else
+			writeUint16LE(output, makeTIMColor(palette[i], false));
+	}
+
+	// Image data, low nibble first as the GPU reads it
+	const uint32 rowBytes = image.width * bitsPerPixel / 8;
+	writeTIMBlockHeader(output, rowBytes * image.height, origX, origY, image.width / pixelsPerWord, image.height);
+
+	byte *row = new byte[rowBytes];
+
+	for (uint32 y = 0; y < image.height; y++) {
+		const uint16 *colors = image.colors + y * image.width;
+		const byte *transparent = image.transparent + y * image.width;
+
+		for (uint32 x = 0; x < image.width; x++) {
+			byte index = transparent[x] ? 0 : colorMap[colors[x]] + firstColor;
+
+			if (bitsPerPixel == 8)
+				row[x] = index;
+			else if (x & 1)
+				row[x / 2] |= index << 4;
+			else
+				row[x / 2] = index;
+		}
+
+		fwrite(row, 1, rowBytes, output);
+	}
+
+	delete[] row;
+	delete[] colorMap;
+	delete[] histogram;
+	return true;
+}
+
+// 15-bit BGR
+bool writeTIM16(FILE *output, Image &image, uint16 origX, uint16 origY) {
+	writeUint32LE(output, 0x10);
+	writeUint32LE(output, 2);
+	writeTIMBlockHeader(output, image.width * image.height * 2, origX, origY, image.width, image.height);
+
+	byte *row = new byte[image.width * 2];
+
+	for (uint32 y = 0; y < image.height; y++) {
+		for (uint32 x = 0; x < image.width; x++) {
+			uint32 i = y * image.width + x;
+			uint16 color = makeTIMColor(image.colors[i], image.transparent[i] != 0);
+			row[x * 2] = color & 0xff;
+			row[x * 2 + 1] = color >> 8;
+		}
+
+		fwrite(row, 1, image.width * 2, output);
+	}
+
+	delete[] row;
+	return true;
+}
+
+int main(int argc, const char **argv) {
+	printf("\nBMP to TIM Converter\n");
+	printf("Converts from BMP to PlayStation TIM files\n");
+	printf("Written by Matthew Hoops (clone2727)\n");
+	printf("See license.txt for the license\n\n");
+
+	if (argc < 4) {
+		printf("Usage: %s <input> <output> <4|8|16> [x y [clut x] [clut y]]\n", argv[0]);
+		return 0;
+	}
+
+	uint16 bitsPerPixel = atoi(argv[3]);
+	if (bitsPerPixel != 4 && bitsPerPixel != 8 && bitsPerPixel != 16) {
+		printf("Unsupported TIM depth %d\n", bitsPerPixel);
+		return 1;
+	}
+
+	uint16 origX = (argc > 4) ? atoi(argv[4]) : 0;
+	uint16 origY = (argc > 5) ? atoi(argv[5]) : 0;
+	uint16 palOrigX = (argc > 6) ? atoi(argv[6]) : 0;
+	uint16 palOrigY = (argc > 7) ? atoi(argv[7]) : 480;
+
+	FILE *input = fopen(argv[1], "rb");
+	if (!input) {
+		printf("Could not open '%s' for reading\n", argv[1]);
+		return 1;
+	}
+
+	Image image;
+	if (!loadBMP(input, image)) {
+		fclose(input);
+		return 1;
+	}
+
+	fclose(input);
+
+	printf("Width = %d\n", image.width);
+	printf("Height = %d\n", image.height);
+
+	FILE *output = fopen(argv[2], "wb");
+	if (!output) {
+		printf("Could not open '%s' for writing\n", argv[2]);
+		return 1;
+	}
+
+	bool result;
+	if (bitsPerPixel == 16)
+		result = writeTIM16(output, image, origX, origY);
+	else
+		result = writeTIMPaletted(output, image, bitsPerPixel, origX, origY, palOrigX, palOrigY);
+
+	fflush(output);
+	fclose(output);
+
+	if (!result)
+		return 1;
+
+	printf("\nAll Done!\n");
+	return 0;
+}
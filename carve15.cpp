@@ -0,0 +1,537 @@
+/* carve15.cpp -- Find raw 15-bit images inside data files
+ * Copyright (c) 2012 Matthew Hoops (clone2727)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+// Saturn and PlayStation games like to keep raw headerless RGB555 pictures
+// (such as the ones dg22bmp and tppsxbgr2bmp convert) packed inside bigger
+// data files with no directory at all. This walks through a file in fixed
+// size windows, keeps the windows that look like 15-bit pixels and reports
+// every run of them along with a guess at the image width.
+//
+// A window looks like pixels when:
+//  - the unused top bit is (nearly) always clear or always set
+//  - the channels are neither constant nor as random as compressed data
+//  - neighbouring pixels are close to each other
+//
+// Runs are only as precise as the window size, so treat the offsets as a
+// range to look around in rather than exact image boundaries.
+
+// Disc images can be past 4GB, even with a 32-bit off_t by default
+#define _FILE_OFFSET_BITS 64
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The file is split into chunks that are scanned on a pool of threads where
+// pthreads are available, and one after another everywhere else
+#ifndef _WIN32
+#define USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Standard types
+typedef unsigned char byte;
+typedef unsigned short uint16;
+typedef unsigned int uint32;
+typedef unsigned long long uint64;
+
+enum {
+	kWindowSize = 4096,
+	kWindowPixels = kWindowSize / 2,
+	kChunkSize = 1024 * 1024, // Bytes scanned by one job, a whole number of windows
+	kSamplePixels = 64 * 1024,
+	kMinWidth = 8,
+	kMaxWidth = 1024,
+	kWidthGuesses = 3
+};
+
+// A window is thrown out if more than this share of its pixels disagree
+// with the majority about the top bit
+static const double kMaxHighBitMix = 1.0 / 16.0;
+
+// Mean channel entropy (in bits, out of 5) of a window must lie in here
+static const double kMinEntropy = 0.5;
+static const double kMaxEntropy = 4.75;
+
+// Mean difference per channel between horizontal neighbours (out of 31).
+// Random data sits around 10.
+static const double kMaxNeighbourDiff = 6.0;
+
+uint32 sumAbsDiff(const byte *a, const byte *b, uint32 length) {
+	uint32 sum = 0;
+	uint32 i = 0;
+
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 16 <= length; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i))));
+
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+
+	for (; i < length; i++)
+		sum += abs(a[i] - b[i]);
+
+	return sum;
+}
+
+// Split the pixels into one plane of 5-bit values per channel, so pixels
+// that are some distance apart can be compared with one shifted sum.
+// Returns how many pixels have the top bit set.
+uint32 splitPlanes(const uint16 *pixels, uint32 count, byte *planes) {
+	uint32 highBits = 0;
+	uint32 i = 0;
+
+#ifdef __SSE2__
+	// Sixteen pixels at a time. The top bits are counted in 16-bit lanes,
+	// which is plenty for a window or a width sample.
+	const __m128i channelMask = _mm_set1_epi16(0x1f);
+	__m128i highBitSum = _mm_setzero_si128();
+
+	for (; i + 16 <= count; i += 16) {
+		__m128i low = _mm_loadu_si128((const __m128i *)(pixels + i));
+		__m128i high = _mm_loadu_si128((const __m128i *)(pixels + i + 8));
+
+		_mm_storeu_si128((__m128i *)(planes + i), _mm_packus_epi16(_mm_and_si128(low, channelMask), _mm_and_si128(high, channelMask)));
+		_mm_storeu_si128((__m128i *)(planes + count + i), _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(low, 5), channelMask),
+				_mm_and_si128(_mm_srli_epi16(high, 5), channelMask)));
+		_mm_storeu_si128((__m128i *)(planes + count * 2 + i), _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(low, 10), channelMask),
+				_mm_and_si128(_mm_srli_epi16(high, 10), channelMask)));
+
+		highBitSum = _mm_add_epi16(highBitSum, _mm_add_epi16(_mm_srli_epi16(low, 15), _mm_srli_epi16(high, 15)));
+	}
+
+	// Widen the lanes in pairs and add them up
+	highBitSum = _mm_madd_epi16(highBitSum, _mm_set1_epi16(1));
+	highBitSum = _mm_add_epi32(highBitSum, _mm_srli_si128(highBitSum, 8));
+	highBitSum = _mm_add_epi32(highBitSum, _mm_srli_si128(highBitSum, 4));
+	highBits = _mm_cvtsi128_si32(highBitSum);
+#endif
+
+	for (; i < count; i++) {
+		planes[i] = pixels[i] & 0x1f;
+		planes[count + i] = (pixels[i] >> 5) & 0x1f;
+		planes[count * 2 + i] = (pixels[i] >> 10) & 0x1f;
+		highBits += pixels[i] >> 15;
+	}
+
+	return highBits;
+}
+
+// Mean difference per channel between each pixel and the one distance
+// pixels before it
+double getPlaneDistance(const byte *planes, uint32 count, uint32 distance) {
+	double total = 0.0;
+
+	for (int i = 0; i < 3; i++)
+		total += sumAbsDiff(planes + i * count + distance, planes + i * count, count - distance);
+
+	return total / (3.0 * (count - distance));
+}
+
+double getEntropy(const uint32 *histogram, uint32 count) {
+	double entropy = 0.0;
+
+	for (int i = 0; i < 32; i++) {
+		if (histogram[i] != 0) {
+			double p = (double)histogram[i] / count;
+			entropy -= p * log(p) / log(2.0);
+		}
+	}
+
+	return entropy;
+}
+
+struct WindowStats {
+	double highBitMix;
+	double entropy;
+	double neighbourDiff;
+};
+
+// The channel planes are split with SSE2, and the histograms are then
+// counted from them a plane at a time
+void analyzeWindow(const uint16 *pixels, uint32 count, byte *planes, WindowStats &stats) {
+	uint32 highBits = splitPlanes(pixels, count, planes);
+	uint32 histogram[3][32];
+	memset(histogram, 0, sizeof(histogram));
+
+	for (int i = 0; i < 3; i++)
+		for (uint32 j = 0; j < count; j++)
+			histogram[i][planes[i * count + j]]++;
+
+	uint32 minority = (highBits < count - highBits) ? highBits : count - highBits;
+	stats.highBitMix = (double)minority / count;
+
+	stats.entropy = 0.0;
+	for (int i = 0; i < 3; i++)
+		stats.entropy += getEntropy(histogram[i], count);
+	stats.entropy /= 3.0;
+
+	stats.neighbourDiff = getPlaneDistance(planes, count, 1);
+}
+
+bool looksLikePixels(const WindowStats &stats) {
+	return stats.highBitMix <= kMaxHighBitMix && stats.entropy >= kMinEntropy &&
+			stats.entropy <= kMaxEntropy && stats.neighbourDiff <= kMaxNeighbourDiff;
+}
+
+// Score every width by how well each row lines up with the one above it
+// and keep the best few. Only local minima are kept, otherwise the width
+// next to the best one would usually take second place.
+uint32 guessWidths(const uint16 *pixels, uint32 count, uint32 *widths, double *scores) {
+	uint32 maxWidth = count / 2;
+	if (maxWidth > kMaxWidth)
+		maxWidth = kMaxWidth;
+
+	if (maxWidth < kMinWidth)
+		return 0;
+
+	byte *planes = new byte[count * 3];
+	splitPlanes(pixels, count, planes);
+
+	double *widthScores = new double[maxWidth + 2];
+	for (uint32 w = kMinWidth - 1; w <= maxWidth + 1; w++)
+		widthScores[w] = getPlaneDistance(planes, count, w);
+
+	uint32 guessCount = 0;
+
+	for (uint32 w = kMinWidth; w <= maxWidth; w++) {
+		double score = widthScores[w];
+
+		if (score > widthScores[w - 1] || score > widthScores[w + 1])
+			continue;
+
+		// Insert into the sorted list of guesses
+		uint32 pos = guessCount;
+		while (pos > 0 && scores[pos - 1] > score)
+			pos--;
+
+		if (pos >= kWidthGuesses)
+			continue;
+
+		uint32 last = (guessCount < kWidthGuesses) ? guessCount : kWidthGuesses - 1;
+		for (uint32 i = last; i > pos; i--) {
+			widths[i] = widths[i - 1];
+			scores[i] = scores[i - 1];
+		}
+
+		widths[pos] = w;
+		scores[pos] = score;
+
+		if (guessCount < kWidthGuesses)
+			guessCount++;
+	}
+
+	delete[] widthScores;
+	delete[] planes;
+	return guessCount;
+}
+
+// Read up to length bytes from offset in the input and return how many
+// there were. With threads, this is a positional read that leaves the
+// descriptor's offset alone, so any number of threads can read from the
+// one descriptor at once.
+uint32 readData(FILE *input, uint64 offset, byte *data, uint32 length) {
+#ifdef USE_THREADS
+	uint32 total = 0;
+
+	while (total < length) {
+		ssize_t count = pread(fileno(input), data + total, length - total, (off_t)(offset + total));
+		if (count <= 0)
+			break;
+
+		total += count;
+	}
+
+	return total;
+#else
+	if (_fseeki64(input, offset, SEEK_SET) != 0)
+		return 0;
+
+	return fread(data, 1, length, input);
+#endif
+}
+
+uint64 getFileSize(FILE *file) {
+#ifdef _WIN32
+	_fseeki64(file, 0, SEEK_END);
+	return _ftelli64(file);
+#else
+	fseeko(file, 0, SEEK_END);
+	return ftello(file);
+#endif
+}
+
+// Put count pixels of the given byte order together from data
+void decodePixels(const byte *data, uint32 count, bool bigEndian, uint16 *pixels) {
+	for (uint32 i = 0; i < count; i++) {
+		if (bigEndian)
+			pixels[i] = (data[i * 2] << 8) | data[i * 2 + 1];
+		else
+			pixels[i] = data[i * 2] | (data[i * 2 + 1] << 8);
+	}
+}
+
+// A run of windows that look like pixels. Only the start of a long run is
+// read back for guessing the width.
+struct Region {
+	uint64 start;
+	uint64 end;
+};
+
+void reportRegion(FILE *input, bool bigEndian, const Region &region) {
+	printf("0x%08llx-0x%08llx  %8llu bytes ", region.start, region.end, region.end - region.start);
+
+	uint32 sampleCount = kSamplePixels;
+	if (sampleCount > (region.end - region.start) / 2)
+		sampleCount = (region.end - region.start) / 2;
+
+	byte *data = new byte[sampleCount * 2];
+	uint16 *sample = new uint16[sampleCount];
+	sampleCount = readData(input, region.start, data, sampleCount * 2) / 2;
+	decodePixels(data, sampleCount, bigEndian, sample);
+
+	uint32 widths[kWidthGuesses];
+	double scores[kWidthGuesses];
+	uint32 guessCount = guessWidths(sample, sampleCount, widths, scores);
+
+	delete[] sample;
+	delete[] data;
+
+	if (guessCount == 0) {
+		printf(" (too small to guess a width)\n");
+		return;
+	}
+
+	printf(" width");
+	for (uint32 i = 0; i < guessCount; i++)
+		printf(" %d (%llu rows, %.2f)", widths[i], (region.end - region.start) / 2 / widths[i], scores[i]);
+	printf("\n");
+}
+
+// The whole file's windows, split into chunks. Each chunk marks its own
+// windows, so the workers only share the chunk counter.
+struct CarveContext {
+	FILE *input; ///< Only ever read with readData()
+	bool bigEndian;
+	byte *isPixels; ///< One flag per window
+	uint32 windowCount;
+	uint32 chunkCount;
+	uint32 nextChunk;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+bool takeChunk(CarveContext &context, uint32 &chunk) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&context.lock);
+#endif
+
+	chunk = context.nextChunk;
+	bool found = chunk < context.chunkCount;
+	if (found)
+		context.nextChunk++;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&context.lock);
+#endif
+
+	return found;
+}
+
+// Keep scanning chunks until there are none left. Each worker reads into
+// its own scratch buffers. A window the file ends partway through doesn't
+// count, and neither does one that couldn't be read.
+void *carveWorker(void *arg) {
+	CarveContext &context = *(CarveContext *)arg;
+	byte *chunkData = new byte[kChunkSize];
+	uint16 *pixels = new uint16[kWindowPixels];
+	byte *planes = new byte[kWindowPixels * 3];
+	uint32 chunk;
+
+	while (takeChunk(context, chunk)) {
+		const uint32 chunkWindows = kChunkSize / kWindowSize;
+		uint32 firstWindow = chunk * chunkWindows;
+		uint32 windowCount = context.windowCount - firstWindow;
+		if (windowCount > chunkWindows)
+			windowCount = chunkWindows;
+
+		uint32 length = readData(context.input, (uint64)firstWindow * kWindowSize, chunkData, windowCount * kWindowSize);
+
+		for (uint32 i = 0; i < windowCount; i++) {
+			bool isPixels = false;
+
+			if ((i + 1) * kWindowSize <= length) {
+				decodePixels(chunkData + i * kWindowSize, kWindowPixels, context.bigEndian, pixels);
+
+				WindowStats stats;
+				analyzeWindow(pixels, kWindowPixels, planes, stats);
+				isPixels = looksLikePixels(stats);
+			}
+
+			context.isPixels[firstWindow + i] = isPixels;
+		}
+	}
+
+	delete[] planes;
+	delete[] pixels;
+	delete[] chunkData;
+	return 0;
+}
+
+uint32 getThreadCount(uint32 jobCount) {
+	uint32 threadCount = 1;
+
+#ifdef USE_THREADS
+	long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpuCount > 1)
+		threadCount = cpuCount;
+#endif
+
+	return (threadCount < jobCount) ? threadCount : (jobCount ? jobCount : 1);
+}
+
+// This thread works through the chunks alongside the extra ones
+void scanChunks(CarveContext &context) {
+#ifdef USE_THREADS
+	pthread_mutex_init(&context.lock, 0);
+
+	uint32 extraThreads = getThreadCount(context.chunkCount) - 1;
+	pthread_t *threads = new pthread_t[extraThreads + 1];
+	uint32 started = 0;
+
+	for (; started < extraThreads; started++)
+		if (pthread_create(&threads[started], 0, carveWorker, &context) != 0)
+			break;
+
+	carveWorker(&context);
+
+	for (uint32 i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+
+	delete[] threads;
+	pthread_mutex_destroy(&context.lock);
+#else
+	carveWorker(&context);
+#endif
+}
+
+// Every window is marked first, and the runs are only put together
+// afterwards, so a run that crosses from one chunk into the next comes out
+// whole. Runs are reported in file order.
+uint32 carveFile(FILE *input, bool bigEndian, uint64 minSize) {
+	uint64 windowCount = getFileSize(input) / kWindowSize;
+	if (windowCount > 0xffffffff) {
+		printf("File is too large\n");
+		return 0;
+	}
+
+	CarveContext context;
+	context.input = input;
+	context.bigEndian = bigEndian;
+	context.windowCount = windowCount;
+	context.isPixels = new byte[context.windowCount + 1];
+	context.chunkCount = (context.windowCount + kChunkSize / kWindowSize - 1) / (kChunkSize / kWindowSize);
+	context.nextChunk = 0;
+
+	scanChunks(context);
+
+	// The extra window at the end closes the last run
+	context.isPixels[context.windowCount] = false;
+
+	Region region;
+	region.start = region.end = 0;
+	bool inRegion = false;
+	uint32 found = 0;
+
+	for (uint32 i = 0; i <= context.windowCount; i++) {
+		uint64 offset = (uint64)i * kWindowSize;
+
+		if (context.isPixels[i]) {
+			if (!inRegion) {
+				region.start = offset;
+				inRegion = true;
+			}
+
+			region.end = offset + kWindowSize;
+		} else if (inRegion) {
+			if (region.end - region.start >= minSize) {
+				reportRegion(input, bigEndian, region);
+				found++;
+			}
+
+			inRegion = false;
+		}
+	}
+
+	delete[] context.isPixels;
+	return found;
+}
+
+int main(int argc, const char **argv) {
+	printf("\nRaw 15-bit Image Carver\n");
+	printf("Finds headerless RGB555 images inside Saturn and PlayStation data\n");
+	printf("Written by Matthew Hoops (clone2727)\n");
+	printf("See license.txt for the license\n\n");
+
+	bool bigEndian = false;
+	uint64 minSize = kWindowSize * 2;
+	int argIndex = 1;
+
+	while (argIndex < argc && !strncmp(argv[argIndex], "--", 2)) {
+		if (!strcmp(argv[argIndex], "--be")) {
+			bigEndian = true;
+			argIndex++;
+		} else if (!strcmp(argv[argIndex], "--min") && argIndex + 1 < argc) {
+			minSize = strtoull(argv[argIndex + 1], 0, 0);
+			argIndex += 2;
+		} else {
+			printf("Unknown option '%s'\n", argv[argIndex]);
+			return 1;
+		}
+	}
+
+	if (argIndex >= argc) {
+		printf("Usage: %s [--be] [--min <bytes>] <input>\n", argv[0]);
+		printf("  --be           Pixels are big-endian (Saturn); the default is little-endian (PlayStation)\n");
+		printf("  --min <bytes>  Smallest run to report (default %d)\n", kWindowSize * 2);
+		return 0;
+	}
+
+	FILE *input = fopen(argv[argIndex], "rb");
+	if (!input) {
+		printf("Could not open '%s' for reading\n", argv[argIndex]);
+		return 1;
+	}
+
+	uint32 found = carveFile(input, bigEndian, minSize);
+	fclose(input);
+
+	printf("\nFound %d candidate region(s)\n", found);
+	return 0;
+}
@@ -20,8 +20,13 @@
 // Thanks to http://multimedia.cx/eggs/brute-force-dimensional-analysis for basic information/samples
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // Standard types
 typedef unsigned char byte;
 typedef unsigned short uint16;
@@ -127,13 +132,141 @@ inline byte isolateBlueChannel(uint16 color) {
 }
 
 // A function for just listing all the factors of a number
-// Could be optimized...
 void listAllFactors(uint32 x) {
 	printf("Factors:\n");
-	printf("(1, %d)\n", x);
-	for (uint32 i = 2; i <= x; i++)
-		if (x % i == 0)
+	for (uint32 i = 1; i <= x / i; i++) {
+		if (x % i == 0) {
 			printf("(%d, %d)\n", i, x / i);
+
+			if (i != x / i)
+				printf("(%d, %d)\n", x / i, i);
+		}
+	}
+}
+
+// Sizes that aren't in the table below are inferred from the pixels. Every
+// factor pair of the pixel count is a candidate, and each candidate width is
+// scored by how much the image changes from one row to the next: with the
+// right width each row sits directly above the next one, with a wrong width
+// the rows are sheared against each other and the differences shoot up.
+// The same goes for the edges in the image (the steps between horizontal
+// neighbours), which only carry on from row to row at the right width. That
+// still tells the widths apart in flat, banded images where the colours
+// alone barely change between rows.
+
+enum {
+	kMinDimension = 8,
+	kMaxAspect = 8
+};
+
+uint32 sumAbsDiff(const byte *a, const byte *b, uint32 length) {
+	uint32 sum = 0;
+	uint32 i = 0;
+
+#ifdef __SSE2__
+	__m128i acc = _mm_setzero_si128();
+
+	for (; i + 16 <= length; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i))));
+
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+
+	for (; i < length; i++)
+		sum += abs(a[i] - b[i]);
+
+	return sum;
+}
+
+// Mean absolute difference per plane between each value and the one a row
+// above it, over the three color planes and the three edge planes. Every
+// plane is stored separately so that a row above is just the same plane
+// shifted by the width.
+double scoreWidth(const byte *planes, uint32 count, uint32 width) {
+	double total = 0.0;
+
+	for (int i = 0; i < 6; i++)
+		total += sumAbsDiff(planes + i * count + width, planes + i * count, count - width);
+
+	return total / (6.0 * (count - width));
+}
+
+bool isCandidateSize(uint32 width, uint32 height) {
+	if (width < kMinDimension || height < kMinDimension || width > 0xffff || height > 0xffff)
+		return false;
+
+	return width <= height * kMaxAspect && height <= width * kMaxAspect;
+}
+
+bool inferDimensions(const uint16 *pixels, uint32 count, uint16 &width, uint16 &height, double &confidence) {
+	byte *planes = new byte[count * 6];
+
+	for (uint32 i = 0; i < count; i++) {
+		planes[i] = pixels[i] & 0x1f;
+		planes[count + i] = (pixels[i] >> 5) & 0x1f;
+		planes[count * 2 + i] = (pixels[i] >> 10) & 0x1f;
+	}
+
+	// The edge planes hold the step from each value to the next one. They
+	// don't depend on the width, so the step across the end of a row is
+	// included too; it's one value per row either way.
+	for (int i = 0; i < 3; i++) {
+		const byte *color = planes + i * count;
+		byte *edge = planes + (i + 3) * count;
+
+		for (uint32 j = 0; j + 1 < count; j++)
+			edge[j] = abs(color[j + 1] - color[j]);
+
+		edge[count - 1] = 0;
+	}
+
+	double bestScore = 0.0, secondScore = 0.0;
+	uint32 candidates = 0;
+
+	for (uint32 i = 1; i <= count / i; i++) {
+		if (count % i != 0)
+			continue;
+
+		uint32 pair[2] = { i, count / i };
+
+		for (int j = 0; j < ((pair[0] == pair[1]) ? 1 : 2); j++) {
+			uint32 w = pair[j];
+			uint32 h = count / w;
+
+			if (!isCandidateSize(w, h))
+				continue;
+
+			double score = scoreWidth(planes, count, w);
+			printf("Candidate %dx%d: %.3f\n", w, h, score);
+
+			if (candidates == 0 || score < bestScore) {
+				secondScore = bestScore;
+				bestScore = score;
+				width = w;
+				height = h;
+			} else if (candidates == 1 || score < secondScore) {
+				secondScore = score;
+			}
+
+			candidates++;
+		}
+	}
+
+	delete[] planes;
+
+	if (candidates == 0)
+		return false;
+
+	// How much better the winner is than the runner-up; a lone candidate
+	// has nothing to compete with.
+	if (candidates == 1)
+		confidence = 1.0;
+	else if (secondScore > 0.0)
+		confidence = 1.0 - bestScore / secondScore;
+	else
+		confidence = 0.0;
+
+	return true;
 }
 
 bool convertDG2ToBMP(FILE *input, FILE *output) {
@@ -173,18 +306,32 @@ bool convertDG2ToBMP(FILE *input, FILE *output) {
 			break;
 	}
 
-	if (width == 0 || height == 0) {
+	if (fileSize < 2 || (fileSize & 1)) {
 		printf("Not a valid DG2 image!\n");
 		return false;
 	}
 
+	const uint32 pixelCount = fileSize / 2;
+	uint16 *pixels = new uint16[pixelCount];
+	for (uint32 i = 0; i < pixelCount; i++)
+		pixels[i] = readUint16BE(input);
+
+	if (width == 0 || height == 0) {
+		double confidence;
+
+		if (!inferDimensions(pixels, pixelCount, width, height, confidence)) {
+			printf("Not a valid DG2 image!\n");
+			listAllFactors(pixelCount);
+			delete[] pixels;
+			return false;
+		}
+
+		printf("Inferred size (confidence %.0f%%)\n", confidence * 100.0);
+	}
+
 	printf("Width = %d\n", width);
 	printf("Height = %d\n", height);
 
-	uint16 *pixels = new uint16[width * height];
-	for (uint32 i = 0; i < width * height; i++)
-		pixels[i] = readUint16BE(input);
-
 	writeBMPHeader(output, width, height, 24);
 
 	const uint32 pitch = width * 3;
@@ -20,8 +20,28 @@
 // Thanks to http://wiki.xentax.com/index.php/Close_Combat_SFX for the format information
 // Highly modified from what the specs say...
 
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+// Sounds are extracted on a pool of threads where pthreads are available,
+// and one after another everywhere else
+#ifndef _WIN32
+#define USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Standard types
 typedef unsigned char byte;
@@ -79,6 +99,31 @@ void writeUint32BE(FILE *file, uint32 x) {
 	writeUint16BE(file, x & 0xffff);
 }
 
+uint16 READ_LE_UINT16(const byte *data) {
+	return (*(data + 1) << 8) | *data;
+}
+
+uint32 READ_LE_UINT32(const byte *data) {
+	return (READ_LE_UINT16(data + 2) << 16) | READ_LE_UINT16(data);
+}
+
+void WRITE_LE_UINT16(byte *data, uint16 x) {
+	data[0] = x & 0xff;
+	data[1] = x >> 8;
+}
+
+void WRITE_LE_UINT32(byte *data, uint32 x) {
+	WRITE_LE_UINT16(data, x & 0xffff);
+	WRITE_LE_UINT16(data + 2, x >> 16);
+}
+
+void WRITE_BE_UINT32(byte *data, uint32 x) {
+	data[0] = x >> 24;
+	data[1] = (x >> 16) & 0xff;
+	data[2] = (x >> 8) & 0xff;
+	data[3] = x & 0xff;
+}
+
 uint32 getFileSize(FILE *file) {
 	uint32 pos = ftell(file);
 	fseek(file, 0, SEEK_END);
@@ -87,6 +132,43 @@ uint32 getFileSize(FILE *file) {
 	return size;
 }
 
+// Read length bytes from offset in the input. With threads, this is a
+// positional read that leaves the descriptor's offset alone, so any number
+// of threads can read from the one descriptor at once.
+bool readData(FILE *input, uint32 offset, byte *data, uint32 length) {
+#ifdef USE_THREADS
+	while (length > 0) {
+		ssize_t count = pread(fileno(input), data, length, offset);
+		if (count <= 0)
+			return false;
+
+		data += count;
+		offset += count;
+		length -= count;
+	}
+
+	return true;
+#else
+	fseek(input, offset, SEEK_SET);
+	return fread(data, 1, length, input) == length;
+#endif
+}
+
+// Constants
+enum {
+	kSFXHeaderSize = 16, // Size of the archive header in front of the sound table
+	kSoundEntrySize = 28, // Size of a SoundEntry in the file
+	kIndexHeaderSize = 20, // Size of the sidecar index header
+	kIndexVersion = 1,
+	kBankHeaderSize = 16, // Size of the sound bank header
+	kBankRecordSize = 16, // Size of a sound bank index record
+	kBankAlignment = 16, // Alignment of the PCM data in a sound bank
+	kBankVersion = 1,
+	kResampleTaps = 32, // Taps per phase of the resampling filter (when not decimating)
+	kWaveHeaderSize = 44,
+	kBufSize = 16384
+};
+
 struct SoundEntry {
 	uint32 length;
 	uint32 offset;
@@ -99,19 +181,380 @@ struct SoundEntry {
 	uint32 unk3;
 };
 
-bool extractSoundToWave(FILE *input, FILE *output, SoundEntry &entry) {
+// Copy length bytes from offset in the input to the current position of
+// the output. Returns false if the input ran out first.
+bool copyData(FILE *input, FILE *output, uint32 offset, uint32 length) {
+#ifdef __linux__
+	// Let the kernel copy the data, which can share the blocks outright
+	// on filesystems with reflinks
+	fflush(output);
+	loff_t inOffset = offset;
+
+	while (length > 0) {
+		ssize_t count = copy_file_range(fileno(input), &inOffset, fileno(output), 0, length, 0);
+		if (count <= 0)
+			break;
+
+		length -= count;
+	}
+
+	// Sync the stdio position back up with the descriptor. Whatever
+	// copy_file_range() couldn't do (e.g. across filesystems on older
+	// kernels) is copied the normal way below.
+	offset = inOffset;
+	fseek(output, 0, SEEK_CUR);
+#endif
+
+	byte buf[kBufSize];
+
+	while (length > 0) {
+		uint32 chunkSize = (length < kBufSize) ? length : kBufSize;
+		if (!readData(input, offset, buf, chunkSize))
+			break;
+
+		fwrite(buf, 1, chunkSize, output);
+		offset += chunkSize;
+		length -= chunkSize;
+	}
+
+	return length == 0;
+}
+
+uint32 getSampleRate(const SoundEntry &entry) {
+	if (entry.channels == 0 || entry.bitsPerSample < 8)
+		return 0;
+
+	return entry.byteRate / entry.channels / (entry.bitsPerSample >> 3);
+}
+
+// Normalisation to a single output format
+
+struct SoundFormat {
+	uint32 rate;
+	uint16 channels;
+	uint16 bitsPerSample;
+};
+
+static const double kPi = 3.14159265358979323846;
+
+uint32 getGCD(uint32 a, uint32 b) {
+	while (b != 0) {
+		uint32 t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+// Polyphase resampling filter for a rate ratio of upFactor/downFactor. Phase
+// p holds the taps for output samples that fall p/upFactor of the way
+// between two input samples.
+struct ResampleFilter {
+	uint32 inRate;
+	uint32 outRate;
+	uint32 upFactor;
+	uint32 downFactor;
+	uint32 taps; // Per phase, always a multiple of 4
+	float *coefficients;
+	ResampleFilter *next; // In the cache
+};
+
+void buildResampleFilter(ResampleFilter &filter, uint32 inRate, uint32 outRate) {
+	uint32 gcd = getGCD(inRate, outRate);
+	filter.inRate = inRate;
+	filter.outRate = outRate;
+	filter.next = 0;
+	filter.upFactor = outRate / gcd;
+	filter.downFactor = inRate / gcd;
+
+	// Cut off at the lower of the two Nyquist frequencies, and widen the
+	// filter by the same amount when decimating so it stays as sharp
+	double cutoff = (outRate < inRate) ? (double)outRate / inRate : 1.0;
+	filter.taps = ((uint32)ceil(kResampleTaps / cutoff) + 3) & ~3;
+	filter.coefficients = new float[filter.upFactor * filter.taps];
+
+	for (uint32 phase = 0; phase < filter.upFactor; phase++) {
+		float *coefficients = filter.coefficients + phase * filter.taps;
+		double sum = 0.0;
+
+		for (uint32 i = 0; i < filter.taps; i++) {
+			// Windowed sinc, centred on the output sample
+			double distance = (double)i - (filter.taps / 2 - 1) - (double)phase / filter.upFactor;
+			double x = distance * cutoff;
+			double sinc = (x == 0.0) ? 1.0 : sin(kPi * x) / (kPi * x);
+			double position = (distance + filter.taps / 2.0) / filter.taps;
+			double window = 0.42 - 0.5 * cos(2.0 * kPi * position) + 0.08 * cos(4.0 * kPi * position);
+
+			coefficients[i] = sinc * window;
+			sum += coefficients[i];
+		}
+
+		// Unity gain at DC for every phase
+		for (uint32 i = 0; i < filter.taps; i++)
+			coefficients[i] /= sum;
+	}
+}
+
+// The filters built so far, one per pair of rates. With rates that share
+// no factors there is one phase per output sample in a second, so building
+// a filter can cost more than using it. An archive only has a handful of
+// rates, so each filter is built the first time it's needed and kept.
+// Filters never change once built, so only the list needs the lock.
+struct FilterCache {
+	ResampleFilter *filters;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+void initFilterCache(FilterCache &cache) {
+	cache.filters = 0;
+
+#ifdef USE_THREADS
+	pthread_mutex_init(&cache.lock, 0);
+#endif
+}
+
+void freeFilterCache(FilterCache &cache) {
+	while (cache.filters) {
+		ResampleFilter *next = cache.filters->next;
+		delete[] cache.filters->coefficients;
+		delete cache.filters;
+		cache.filters = next;
+	}
+
+#ifdef USE_THREADS
+	pthread_mutex_destroy(&cache.lock);
+#endif
+}
+
+// Get the filter for a pair of rates, building it if it's not cached yet.
+// A worker that needs a filter another one is building waits for it.
+const ResampleFilter &getResampleFilter(FilterCache &cache, uint32 inRate, uint32 outRate) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&cache.lock);
+#endif
+
+	ResampleFilter *filter = cache.filters;
+	while (filter && (filter->inRate != inRate || filter->outRate != outRate))
+		filter = filter->next;
+
+	if (!filter) {
+		filter = new ResampleFilter;
+		buildResampleFilter(*filter, inRate, outRate);
+		filter->next = cache.filters;
+		cache.filters = filter;
+	}
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&cache.lock);
+#endif
+
+	return *filter;
+}
+
+// Sum of count products, count being a multiple of 4
+float dotProduct(const float *a, const float *b, uint32 count) {
+	uint32 i = 0;
+	float result = 0.0f;
+
+#ifdef __SSE2__
+	__m128 sum = _mm_setzero_ps();
+
+	for (; i < count; i += 4)
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+
+	float parts[4];
+	_mm_storeu_ps(parts, sum);
+	result = (parts[0] + parts[1]) + (parts[2] + parts[3]);
+#endif
+
+	for (; i < count; i++)
+		result += a[i] * b[i];
+
+	return result;
+}
+
+inline float decodeSample(const byte *data, uint16 bitsPerSample) {
+	if (bitsPerSample == 8)
+		return (data[0] - 128) / 128.0f;
+
+	return (short)READ_LE_UINT16(data) / 32768.0f;
+}
+
+inline void encodeSample(byte *data, uint16 bitsPerSample, float sample) {
+	if (bitsPerSample == 8) {
+		int value = (int)floor(sample * 128.0f + 0.5f) + 128;
+		data[0] = (value < 0) ? 0 : (value > 255) ? 255 : value;
+	} else {
+		int value = (int)floor(sample * 32768.0f + 0.5f);
+		WRITE_LE_UINT16(data, (value < -32768) ? -32768 : (value > 32767) ? 32767 : value);
+	}
+}
+
+bool canNormalizeSound(const SoundEntry &entry) {
+	return getSampleRate(entry) != 0 && (entry.channels == 1 || entry.channels == 2)
+			&& (entry.bitsPerSample == 8 || entry.bitsPerSample == 16);
+}
+
+uint32 getNormalizedLength(const SoundEntry &entry, const SoundFormat &format) {
+	uint32 inRate = getSampleRate(entry);
+	uint32 inFrames = entry.length / (entry.channels * (entry.bitsPerSample >> 3));
+	uint32 outFrames = ((unsigned long long)inFrames * format.rate + inRate - 1) / inRate;
+	return outFrames * format.channels * (format.bitsPerSample >> 3);
+}
+
+// Convert a sound's PCM data to the given format: resample it, mix it down
+// or up, and change the sample size. Returns the new data, which is
+// getNormalizedLength() bytes long.
+byte *normalizeSound(const byte *data, const SoundEntry &entry, const SoundFormat &format, FilterCache &filters) {
+	uint32 inRate = getSampleRate(entry);
+	uint32 inBytes = entry.bitsPerSample >> 3;
+	uint32 inFrames = entry.length / (entry.channels * inBytes);
+	uint32 outFrames = ((unsigned long long)inFrames * format.rate + inRate - 1) / inRate;
+
+	// Only resample as many channels as both formats have; stereo is mixed
+	// down first and mono is duplicated last
+	uint32 channels = (entry.channels < format.channels) ? entry.channels : format.channels;
+
+	const ResampleFilter &filter = getResampleFilter(filters, inRate, format.rate);
+
+	// Deinterleave into float channels, padded with silence on both sides
+	// for the filter
+	uint32 padding = filter.taps / 2;
+	float *input[2] = { 0, 0 };
+	float *output[2] = { 0, 0 };
+
+	for (uint32 c = 0; c < channels; c++) {
+		input[c] = new float[inFrames + filter.taps];
+		memset(input[c], 0, (inFrames + filter.taps) * sizeof(float));
+		output[c] = new float[outFrames];
+	}
+
+	const byte *src = data;
+	for (uint32 i = 0; i < inFrames; i++) {
+		float left = decodeSample(src, entry.bitsPerSample);
+		float right = (entry.channels == 2) ? decodeSample(src + inBytes, entry.bitsPerSample) : left;
+		src += entry.channels * inBytes;
+
+		if (channels == 1) {
+			input[0][padding + i] = (left + right) * 0.5f;
+		} else {
+			input[0][padding + i] = left;
+			input[1][padding + i] = right;
+		}
+	}
+
+	for (uint32 c = 0; c < channels; c++) {
+		if (inRate == format.rate) {
+			memcpy(output[c], input[c] + padding, outFrames * sizeof(float));
+			continue;
+		}
+
+		// Step through the input by downFactor/upFactor per output sample
+		uint32 position = 0;
+		uint32 phase = 0;
+		uint32 step = filter.downFactor / filter.upFactor;
+		uint32 phaseStep = filter.downFactor % filter.upFactor;
+
+		for (uint32 i = 0; i < outFrames; i++) {
+			output[c][i] = dotProduct(input[c] + position + 1, filter.coefficients + phase * filter.taps, filter.taps);
+
+			position += step;
+			phase += phaseStep;
+			if (phase >= filter.upFactor) {
+				phase -= filter.upFactor;
+				position++;
+			}
+		}
+	}
+
+	uint32 outBytes = format.bitsPerSample >> 3;
+	byte *normalized = new byte[outFrames * format.channels * outBytes];
+	byte *dst = normalized;
+
+	for (uint32 i = 0; i < outFrames; i++) {
+		for (uint32 c = 0; c < format.channels; c++) {
+			encodeSample(dst, format.bitsPerSample, output[(c < channels) ? c : 0][i]);
+			dst += outBytes;
+		}
+	}
+
+	for (uint32 c = 0; c < channels; c++) {
+		delete[] input[c];
+		delete[] output[c];
+	}
+
+	return normalized;
+}
+
+// Read a sound's PCM data into the buffer and convert it to the given
+// format. Returns 0 if the data is truncated.
+byte *readNormalizedSound(FILE *input, const SoundEntry &entry, const SoundFormat &format, FilterCache &filters, byte *buffer, uint32 bufferSize) {
+	// Only a sound running past the end of the archive can be bigger
+	// than the buffer
+	if (entry.length > bufferSize || !readData(input, entry.offset, buffer, entry.length))
+		return 0;
+
+	return normalizeSound(buffer, entry, format, filters);
+}
+
+// Get the size of a buffer that holds any of the selected sounds. Sounds
+// too big to be in the archive at all are left out.
+uint32 getBufferSize(const SoundEntry *entries, uint32 fileCount, const bool *selected, uint32 archiveSize) {
+	uint32 bufferSize = 0;
+
+	for (uint32 i = 0; i < fileCount; i++)
+		if ((!selected || selected[i]) && entries[i].length <= archiveSize && entries[i].length > bufferSize)
+			bufferSize = entries[i].length;
+
+	return bufferSize;
+}
+
+void writeWaveHeader(FILE *output, uint32 length, uint16 channels, uint32 rate, uint32 byteRate, uint16 bitsPerSample) {
+	byte header[kWaveHeaderSize];
+	WRITE_BE_UINT32(header, 'RIFF');
+	WRITE_LE_UINT32(header + 4, length + 36);
+	WRITE_BE_UINT32(header + 8, 'WAVE');
+	WRITE_BE_UINT32(header + 12, 'fmt ');
+	WRITE_LE_UINT32(header + 16, 16);
+	WRITE_LE_UINT16(header + 20, 1);
+	WRITE_LE_UINT16(header + 22, channels);
+	WRITE_LE_UINT32(header + 24, rate);
+	WRITE_LE_UINT32(header + 28, byteRate);
+	WRITE_LE_UINT16(header + 32, channels * (bitsPerSample >> 3));
+	WRITE_LE_UINT16(header + 34, bitsPerSample);
+	WRITE_BE_UINT32(header + 36, 'data');
+	WRITE_LE_UINT32(header + 40, length);
+
+	fwrite(header, 1, sizeof(header), output);
+}
+
+// How far extracting a sound got. Nothing is printed while extracting;
+// the messages are printed afterwards, in archive order.
+enum ExtractStatus {
+	kStatusPending, // Never started
+	kStatusDone,
+	kStatusNoOutput,
+	kStatusBadFlags,
+	kStatusCannotConvert,
+	kStatusTruncated
+};
+
+// Write a sound as a WAVE file, converting it to format if one is given.
+// The filters and the buffer are only needed when converting.
+ExtractStatus extractSoundToWave(FILE *input, FILE *output, const SoundEntry &entry, const SoundFormat *format, FilterCache &filters, byte *buffer, uint32 bufferSize) {
 	if (entry.unk1 != 1) {
 		// Possibly a signed flag?
 		// Compression flag (ie. 1 = PCM from the WAVE format)?
-		printf("unk1 = %d\n", entry.unk1);
-		return false;
+		return kStatusBadFlags;
 	}
 
 	if (entry.unk1 != 1 && entry.unk2 != 2) {
 		// This seems to not have an effect...
 		// channels/2?
-		printf("unk2 = %d\n", entry.unk2);
-		return false;
+		return kStatusBadFlags;
 	}
 
 	if (entry.unkRate != 22050) {
@@ -122,111 +565,614 @@ bool extractSoundToWave(FILE *input, FILE *output, SoundEntry &entry) {
 		//return false;
 	}
 
-	if (entry.bitsPerSample != 16)
-		printf("Untested bitsPerSample %d\n", entry.bitsPerSample);
+	if (format) {
+		if (!canNormalizeSound(entry))
+			return kStatusCannotConvert;
 
-	fseek(input, entry.offset, SEEK_SET);
+		byte *data = readNormalizedSound(input, entry, *format, filters, buffer, bufferSize);
+		if (!data)
+			return kStatusTruncated;
 
-	byte *data = new byte[entry.length];
-	fread(data, 1, entry.length, input);
+		uint32 length = getNormalizedLength(entry, *format);
+		uint16 blockAlign = format->channels * (format->bitsPerSample >> 3);
+		writeWaveHeader(output, length, format->channels, format->rate, format->rate * blockAlign, format->bitsPerSample);
+		fwrite(data, 1, length, output);
+		delete[] data;
+		return kStatusDone;
+	}
 
-	writeUint32BE(output, 'RIFF');
-	writeUint32LE(output, entry.length + 44);
-	writeUint32BE(output, 'WAVE');
-	writeUint32BE(output, 'fmt ');
-	writeUint32LE(output, 16);
-	writeUint16LE(output, 1);
-	writeUint16LE(output, entry.channels);
-	writeUint32LE(output, entry.byteRate / entry.channels / (entry.bitsPerSample >> 3));
-	writeUint32LE(output, entry.byteRate);
-	writeUint16LE(output, entry.channels * (entry.bitsPerSample >> 3));
-	writeUint16LE(output, entry.bitsPerSample);
-	writeUint32BE(output, 'data');
-	writeUint32LE(output, entry.length);
+	writeWaveHeader(output, entry.length, entry.channels, getSampleRate(entry), entry.byteRate, entry.bitsPerSample);
 
-	fwrite(data, 1, entry.length, output);
+	// The PCM data is stored as-is
+	return copyData(input, output, entry.offset, entry.length) ? kStatusDone : kStatusTruncated;
+}
 
-	delete[] data;
-	return true;
+static const SoundEntry *s_sortEntries = 0;
+
+int compareEntryOffsets(const void *a, const void *b) {
+	uint32 offsetA = s_sortEntries[*(const uint32 *)a].offset;
+	uint32 offsetB = s_sortEntries[*(const uint32 *)b].offset;
+	return (offsetA < offsetB) ? -1 : (offsetA > offsetB) ? 1 : 0;
 }
 
-bool extractAllFiles(FILE *input) {
-	uint32 fileCount = readUint32LE(input);
+// Read the raw SoundEntry table from the start of the archive
+byte *readSoundTable(FILE *input, uint32 &fileCount) {
+	fileCount = readUint32LE(input);
 	uint32 unk0 = readUint32LE(input);
 	readUint32LE(input); // Always 0
 	readUint32LE(input); // Always 0
-	
 
 	if (unk0 != 99) {
 		printf("Second SFX field is not 99\n");
-		return false;
+		return 0;
 	}
 
+	// Make sure the table fits in the archive before allocating it
+	uint32 fileSize = getFileSize(input);
+	if (fileSize < kSFXHeaderSize || fileCount > (fileSize - kSFXHeaderSize) / kSoundEntrySize) {
+		printf("Sound table is truncated\n");
+		return 0;
+	}
+
+	// Read the whole table in one go and decode it from memory
+	byte *table = new byte[fileCount * kSoundEntrySize];
+	if (fread(table, kSoundEntrySize, fileCount, input) != fileCount) {
+		printf("Sound table is truncated\n");
+		delete[] table;
+		return 0;
+	}
+
+	return table;
+}
+
+SoundEntry *decodeSoundTable(const byte *table, uint32 fileCount) {
 	SoundEntry *entries = new SoundEntry[fileCount];
 
 	for (uint32 i = 0; i < fileCount; i++) {
-		entries[i].length = readUint32LE(input);
-		entries[i].offset = readUint32LE(input);
-		entries[i].unk1 = readUint16LE(input);
-		entries[i].unk2 = readUint16LE(input);
-		entries[i].unkRate = readUint32LE(input);
-		entries[i].byteRate = readUint32LE(input);
-		entries[i].channels = readUint16LE(input);
-		entries[i].bitsPerSample = readUint16LE(input);
-		entries[i].unk3 = readUint32LE(input);
+		const byte *record = table + i * kSoundEntrySize;
+		entries[i].length = READ_LE_UINT32(record);
+		entries[i].offset = READ_LE_UINT32(record + 4);
+		entries[i].unk1 = READ_LE_UINT16(record + 8);
+		entries[i].unk2 = READ_LE_UINT16(record + 10);
+		entries[i].unkRate = READ_LE_UINT32(record + 12);
+		entries[i].byteRate = READ_LE_UINT32(record + 16);
+		entries[i].channels = READ_LE_UINT16(record + 20);
+		entries[i].bitsPerSample = READ_LE_UINT16(record + 22);
+		entries[i].unk3 = READ_LE_UINT32(record + 24);
 	}
 
-	bool allDone = true;
+	return entries;
+}
+
+// The sidecar index (<archive>.idx) is a copy of the raw sound table behind
+// a small header holding the archive's size and modification time. If
+// either no longer matches, the index is stale and the archive is parsed
+// again.
+
+bool getArchiveStamp(const char *filename, uint32 &size, uint32 &mtime) {
+	struct stat status;
+	if (stat(filename, &status) != 0)
+		return false;
+
+	size = status.st_size;
+	mtime = status.st_mtime;
+	return true;
+}
+
+char *getIndexFilename(const char *filename) {
+	char *indexName = new char[strlen(filename) + 5];
+	strcpy(indexName, filename);
+	strcat(indexName, ".idx");
+	return indexName;
+}
+
+byte *readSidecarIndex(const char *indexName, uint32 size, uint32 mtime, uint32 &fileCount) {
+	FILE *file = fopen(indexName, "rb");
+	if (!file)
+		return 0;
+
+	byte header[kIndexHeaderSize];
+	byte *table = 0;
+
+	if (fread(header, 1, kIndexHeaderSize, file) == kIndexHeaderSize && !memcmp(header, "SFXI", 4)
+			&& READ_LE_UINT32(header + 4) == kIndexVersion && READ_LE_UINT32(header + 8) == size
+			&& READ_LE_UINT32(header + 12) == mtime) {
+		fileCount = READ_LE_UINT32(header + 16);
+
+		// Check the count against the size first so the product can't wrap
+		uint32 fileSize = getFileSize(file);
+		uint32 maxCount = (fileSize - kIndexHeaderSize) / kSoundEntrySize;
+
+		if (fileCount <= maxCount && fileSize == kIndexHeaderSize + fileCount * kSoundEntrySize) {
+			table = new byte[fileCount * kSoundEntrySize];
+
+			if (fread(table, kSoundEntrySize, fileCount, file) != fileCount) {
+				delete[] table;
+				table = 0;
+			}
+		}
+	}
+
+	fclose(file);
+	return table;
+}
+
+bool writeSidecarIndex(const char *indexName, uint32 size, uint32 mtime, const byte *table, uint32 fileCount) {
+	FILE *file = fopen(indexName, "wb");
+	if (!file)
+		return false;
+
+	byte header[kIndexHeaderSize];
+	WRITE_BE_UINT32(header, 'SFXI');
+	WRITE_LE_UINT32(header + 4, kIndexVersion);
+	WRITE_LE_UINT32(header + 8, size);
+	WRITE_LE_UINT32(header + 12, mtime);
+	WRITE_LE_UINT32(header + 16, fileCount);
+
+	bool written = fwrite(header, 1, kIndexHeaderSize, file) == kIndexHeaderSize
+			&& fwrite(table, kSoundEntrySize, fileCount, file) == fileCount;
+
+	fclose(file);
+	return written;
+}
+
+void listSounds(const SoundEntry *entries, uint32 fileCount, const bool *selected, bool json) {
+	if (json)
+		printf("[\n");
+	else
+		printf("%5s %10s %10s %6s %8s %4s\n", "Entry", "Offset", "Size", "Rate", "Channels", "Bits");
+
+	bool first = true;
 
 	for (uint32 i = 0; i < fileCount; i++) {
-		static char filename[32];
-		memset(filename, 0, sizeof(filename));
-		sprintf(filename, "%d.wav", i);
+		if (selected && !selected[i])
+			continue;
+
+		const SoundEntry &entry = entries[i];
+
+		if (json) {
+			printf("%s\t{\"entry\": %d, \"offset\": %u, \"size\": %u, \"rate\": %u, \"channels\": %d, \"bits\": %d}",
+					first ? "" : ",\n", i, entry.offset, entry.length, getSampleRate(entry), entry.channels, entry.bitsPerSample);
+		} else {
+			printf("%5d %10u %10u %6u %8d %4d\n", i, entry.offset, entry.length,
+					getSampleRate(entry), entry.channels, entry.bitsPerSample);
+		}
+
+		first = false;
+	}
+
+	if (json)
+		printf("%s]\n", first ? "" : "\n");
+}
+
+// Get the entry numbers sorted by where their data is stored, so the
+// archive is only ever read forwards
+uint32 *getEntryOrder(const SoundEntry *entries, uint32 fileCount) {
+	uint32 *order = new uint32[fileCount];
+	for (uint32 i = 0; i < fileCount; i++)
+		order[i] = i;
+
+	s_sortEntries = entries;
+	qsort(order, fileCount, sizeof(uint32), compareEntryOffsets);
+	return order;
+}
+
+// One sound to extract. The status is filled in by whichever thread picks
+// it up.
+struct ExtractJob {
+	uint32 entry;
+	ExtractStatus status;
+};
+
+struct ExtractContext {
+	FILE *input; ///< Only ever read with readData()
+	const SoundEntry *entries;
+	const SoundFormat *format;
+	FilterCache filters; ///< Shared by all the workers
+	ExtractJob *jobs;
+	uint32 jobCount;
+	uint32 nextJob;
+	uint32 bufferSize; ///< Enough for the biggest sound, when converting
+	bool failed;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+// Once a sound has failed, no more jobs are handed out
+bool takeJob(ExtractContext &context, uint32 &index) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&context.lock);
+#endif
+
+	index = context.nextJob;
+	bool found = !context.failed && index < context.jobCount;
+	if (found)
+		context.nextJob++;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&context.lock);
+#endif
+
+	return found;
+}
+
+void stopJobs(ExtractContext &context) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&context.lock);
+#endif
+
+	context.failed = true;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&context.lock);
+#endif
+}
+
+// Keep taking sounds until there are none left. Every sound goes to its
+// own file and is read with positional reads, so the workers share the
+// archive without waiting for each other.
+void *extractWorker(void *arg) {
+	ExtractContext &context = *(ExtractContext *)arg;
+	byte *buffer = context.bufferSize ? new byte[context.bufferSize] : 0;
+	uint32 index;
+
+	while (takeJob(context, index)) {
+		ExtractJob &job = context.jobs[index];
+
+		char filename[32];
+		sprintf(filename, "%d.wav", job.entry);
 
 		FILE *output = fopen(filename, "wb");
 		if (!output) {
-			printf("Could not open '%s' for writing\n", filename);
-			allDone = false;
+			job.status = kStatusNoOutput;
+		} else {
+			job.status = extractSoundToWave(context.input, output, context.entries[job.entry], context.format, context.filters, buffer, context.bufferSize);
+			fflush(output);
+			fclose(output);
+		}
+
+		if (job.status != kStatusDone)
+			stopJobs(context);
+	}
+
+	delete[] buffer;
+	return 0;
+}
+
+uint32 getThreadCount(uint32 jobCount) {
+	uint32 threadCount = 1;
+
+#ifdef USE_THREADS
+	long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpuCount > 1)
+		threadCount = cpuCount;
+#endif
+
+	return (threadCount < jobCount) ? threadCount : (jobCount ? jobCount : 1);
+}
+
+// This thread works through the jobs alongside the extra ones
+void extractAllSounds(ExtractContext &context) {
+#ifdef USE_THREADS
+	pthread_mutex_init(&context.lock, 0);
+
+	uint32 extraThreads = getThreadCount(context.jobCount) - 1;
+	pthread_t *threads = new pthread_t[extraThreads + 1];
+	uint32 started = 0;
+
+	for (; started < extraThreads; started++)
+		if (pthread_create(&threads[started], 0, extractWorker, &context) != 0)
 			break;
+
+	extractWorker(&context);
+
+	for (uint32 i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+
+	delete[] threads;
+	pthread_mutex_destroy(&context.lock);
+#else
+	extractWorker(&context);
+#endif
+}
+
+bool extractFiles(FILE *input, const SoundEntry *entries, uint32 fileCount, const bool *selected, const SoundFormat *format) {
+	ExtractContext context;
+	context.input = input;
+	context.entries = entries;
+	context.format = format;
+	initFilterCache(context.filters);
+	context.jobs = new ExtractJob[fileCount];
+	context.jobCount = 0;
+	context.nextJob = 0;
+	context.bufferSize = format ? getBufferSize(entries, fileCount, selected, getFileSize(input)) : 0;
+	context.failed = false;
+
+	// Hand the sounds out in archive order so the reads still mostly
+	// move forwards
+	uint32 *order = getEntryOrder(entries, fileCount);
+
+	for (uint32 n = 0; n < fileCount; n++) {
+		uint32 i = order[n];
+		if (selected && !selected[i])
+			continue;
+
+		context.jobs[context.jobCount].entry = i;
+		context.jobs[context.jobCount].status = kStatusPending;
+		context.jobCount++;
+	}
+
+	delete[] order;
+
+	extractAllSounds(context);
+
+	// Report in archive order once everything is done
+	bool allDone = true;
+
+	for (uint32 n = 0; n < context.jobCount; n++) {
+		const ExtractJob &job = context.jobs[n];
+		const SoundEntry &entry = entries[job.entry];
+
+		if (job.status == kStatusPending)
+			continue;
+
+		if (job.status == kStatusNoOutput) {
+			printf("Could not open '%d.wav' for writing\n", job.entry);
+			allDone = false;
+			continue;
+		}
+
+		printf("Extracting %d.wav...\n", job.entry);
+
+		if (job.status == kStatusBadFlags) {
+			printf("unk1 = %d\n", entry.unk1);
+			allDone = false;
+			continue;
 		}
 
-		printf("Extracting %s...\n", filename);
+		if (entry.bitsPerSample != 16)
+			printf("Untested bitsPerSample %d\n", entry.bitsPerSample);
 
-		if (!extractSoundToWave(input, output, entries[i])) {
+		if (job.status == kStatusCannotConvert) {
+			printf("Cannot convert %d-bit sound with %d channels at %dHz\n", entry.bitsPerSample, entry.channels, getSampleRate(entry));
+			allDone = false;
+		} else if (job.status == kStatusTruncated) {
+			printf("Sound data is truncated\n");
+			allDone = false;
+		}
+	}
+
+	freeFilterCache(context.filters);
+	delete[] context.jobs;
+	return allDone;
+}
+
+// Write the selected sounds into a single bank: a header, one index record
+// per table entry, then the raw PCM of each sound starting on a 16-byte
+// boundary. Unselected entries keep an empty record so entry numbers match
+// the archive. If a format is given, every sound is converted to it first.
+// sfxbank.h documents the layout and reads it back.
+bool writeSoundBank(FILE *input, FILE *output, const SoundEntry *entries, uint32 fileCount, const bool *selected, const SoundFormat *format) {
+	uint32 indexSize = kBankHeaderSize + fileCount * kBankRecordSize;
+	byte *index = new byte[indexSize];
+	memset(index, 0, indexSize);
+
+	memcpy(index, "SFXB", 4);
+	WRITE_LE_UINT32(index + 4, kBankVersion);
+	WRITE_LE_UINT32(index + 8, fileCount);
+
+	// Lay the data out in archive order so both files are accessed
+	// sequentially
+	uint32 *order = getEntryOrder(entries, fileCount);
+	uint32 bankOffset = indexSize;
+
+	for (uint32 n = 0; n < fileCount; n++) {
+		uint32 i = order[n];
+		if (selected && !selected[i])
+			continue;
+
+		if (format && !canNormalizeSound(entries[i])) {
+			printf("Cannot convert sound %d\n", i);
+			delete[] index;
+			delete[] order;
+			return false;
+		}
+
+		uint32 length = format ? getNormalizedLength(entries[i], *format) : entries[i].length;
+
+		byte *record = index + kBankHeaderSize + i * kBankRecordSize;
+		WRITE_LE_UINT32(record, bankOffset);
+		WRITE_LE_UINT32(record + 4, length);
+		WRITE_LE_UINT32(record + 8, format ? format->rate : getSampleRate(entries[i]));
+		WRITE_LE_UINT16(record + 12, format ? format->channels : entries[i].channels);
+		WRITE_LE_UINT16(record + 14, format ? format->bitsPerSample : entries[i].bitsPerSample);
+
+		bankOffset += (length + kBankAlignment - 1) & ~(kBankAlignment - 1);
+	}
+
+	fwrite(index, 1, indexSize, output);
+	delete[] index;
+
+	static const byte padding[kBankAlignment] = { 0 };
+	uint32 bufferSize = format ? getBufferSize(entries, fileCount, selected, getFileSize(input)) : 0;
+	byte *buffer = bufferSize ? new byte[bufferSize] : 0;
+	bool allDone = true;
+
+	FilterCache filters;
+	initFilterCache(filters);
+
+	for (uint32 n = 0; n < fileCount; n++) {
+		uint32 i = order[n];
+		if (selected && !selected[i])
+			continue;
+
+		printf("Adding sound %d...\n", i);
+
+		uint32 length = entries[i].length;
+
+		if (format) {
+			byte *data = readNormalizedSound(input, entries[i], *format, filters, buffer, bufferSize);
+			if (!data) {
+				printf("Sound %d is truncated\n", i);
+				allDone = false;
+				break;
+			}
+
+			length = getNormalizedLength(entries[i], *format);
+			fwrite(data, 1, length, output);
+			delete[] data;
+		} else if (!copyData(input, output, entries[i].offset, length)) {
+			printf("Sound %d is truncated\n", i);
 			allDone = false;
 			break;
 		}
 
-		fflush(output);
-		fclose(output);
+		uint32 extra = length & (kBankAlignment - 1);
+		if (extra)
+			fwrite(padding, 1, kBankAlignment - extra, output);
 	}
 
-	delete[] entries;
+	freeFilterCache(filters);
+	delete[] buffer;
+	delete[] order;
 	return allDone;
 }
 
 int main(int argc, const char **argv) {
-	printf("\nCC3/CC4/CC5 SFX Sound Extractor\n");
-	printf("Converts files from CC3/CC4/CC5 SFX files to WAVE\n");
-	printf("Written by Matthew Hoops (clone2727)\n");
-	printf("See license.txt for the license\n\n");
+	bool listEntries = false;
+	bool listJSON = false;
+	bool saveIndex = false;
+	const char *bankName = 0;
+	SoundFormat format;
+	bool normalize = false;
+
+	int argIndex = 1;
+	for (; argIndex < argc && !strncmp(argv[argIndex], "--", 2); argIndex++) {
+		if (!strcmp(argv[argIndex], "--list")) {
+			listEntries = true;
+		} else if (!strcmp(argv[argIndex], "--json")) {
+			listEntries = true;
+			listJSON = true;
+		} else if (!strcmp(argv[argIndex], "--index")) {
+			saveIndex = true;
+		} else if (!strcmp(argv[argIndex], "--bank") && argIndex + 1 < argc) {
+			bankName = argv[++argIndex];
+		} else if (!strcmp(argv[argIndex], "--normalize") && argIndex + 3 < argc) {
+			format.rate = atoi(argv[argIndex + 1]);
+			format.bitsPerSample = atoi(argv[argIndex + 2]);
+			format.channels = atoi(argv[argIndex + 3]);
+			argIndex += 3;
+			normalize = true;
+
+			if (format.rate == 0 || (format.bitsPerSample != 8 && format.bitsPerSample != 16) || (format.channels != 1 && format.channels != 2)) {
+				printf("Unsupported output format %s %s %s\n", argv[argIndex - 2], argv[argIndex - 1], argv[argIndex]);
+				return 1;
+			}
+		} else {
+			printf("Unknown option '%s'\n", argv[argIndex]);
+			return 1;
+		}
+	}
+
+	// Keep listings free of the banner so they can be piped elsewhere
+	if (!listEntries) {
+		printf("\nCC3/CC4/CC5 SFX Sound Extractor\n");
+		printf("Converts files from CC3/CC4/CC5 SFX files to WAVE\n");
+		printf("Written by Matthew Hoops (clone2727)\n");
+		printf("See license.txt for the license\n\n");
+	}
 
-	if (argc < 2) {
-		printf("Usage: %s <input>\n", argv[0]);
+	if (argIndex >= argc) {
+		printf("Usage: %s [--list] [--json] [--index] [--bank <output>]\n", argv[0]);
+		printf("       [--normalize <rate> <8|16> <1|2>] <input> [entry ...]\n");
+		printf("  --list   List the sound table instead of extracting\n");
+		printf("  --json   List the sound table as JSON\n");
+		printf("  --index  Save the sound table to <input>.idx for later runs\n");
+		printf("  --bank   Write the sounds into one aligned PCM bank instead of WAVs\n");
+		printf("  --normalize  Convert every sound to one rate, sample size and channel count\n");
 		return 0;
 	}
 
-	FILE *input = fopen(argv[1], "rb");
-	if (!input) {
-		printf("Could not open '%s' for reading\n", argv[1]);
-		return 1;
+	const char *inputName = argv[argIndex++];
+
+	uint32 archiveSize = 0, archiveTime = 0;
+	bool haveStamp = getArchiveStamp(inputName, archiveSize, archiveTime);
+	char *indexName = getIndexFilename(inputName);
+
+	// A valid index means the archive itself is only needed for extraction
+	uint32 fileCount = 0;
+	byte *table = haveStamp ? readSidecarIndex(indexName, archiveSize, archiveTime, fileCount) : 0;
+	bool indexValid = table != 0;
+
+	FILE *input = 0;
+	if (!listEntries || !indexValid) {
+		input = fopen(inputName, "rb");
+		if (!input) {
+			printf("Could not open '%s' for reading\n", inputName);
+			return 1;
+		}
+	}
+
+	if (!indexValid) {
+		table = readSoundTable(input, fileCount);
+		if (!table)
+			return 1;
+
+		if (saveIndex && (!haveStamp || !writeSidecarIndex(indexName, archiveSize, archiveTime, table, fileCount)))
+			printf("Could not write index '%s'\n", indexName);
+	}
+
+	SoundEntry *entries = decodeSoundTable(table, fileCount);
+	delete[] table;
+	delete[] indexName;
+
+	// Any remaining arguments select entries by number
+	bool *selected = 0;
+	if (argIndex < argc) {
+		selected = new bool[fileCount];
+		memset(selected, 0, fileCount * sizeof(bool));
+
+		for (; argIndex < argc; argIndex++) {
+			char *end;
+			unsigned long entry = strtoul(argv[argIndex], &end, 10);
+
+			if (*end || end == argv[argIndex] || entry >= fileCount) {
+				printf("No sound entry '%s'\n", argv[argIndex]);
+				return 1;
+			}
+
+			selected[entry] = true;
+		}
 	}
 
-	if (!extractAllFiles(input))
+	bool success = true;
+	if (listEntries) {
+		listSounds(entries, fileCount, selected, listJSON);
+	} else if (bankName) {
+		FILE *output = fopen(bankName, "wb");
+		if (!output) {
+			printf("Could not open '%s' for writing\n", bankName);
+			return 1;
+		}
+
+		success = writeSoundBank(input, output, entries, fileCount, selected, normalize ? &format : 0);
+		fclose(output);
+	} else {
+		success = extractFiles(input, entries, fileCount, selected, normalize ? &format : 0);
+	}
+
+	delete[] selected;
+	delete[] entries;
+
+	if (!success)
 		return 1;
 
-	fclose(input);
+	if (input)
+		fclose(input);
+
+	if (!listEntries)
+		printf("All Done!\n");
 
-	printf("All Done!\n");
 	return 0;
 }
@@ -19,8 +19,24 @@
 
 // Thanks to http://wiki.xentax.com/index.php/Close_Combat_4_PIX for the format information
 
+#include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Pictures are extracted, and atlas thumbnails drawn, on a pool of threads
+// where pthreads are available, and one after another everywhere else
+#ifndef _WIN32
+#define USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 // Standard types
 typedef unsigned char byte;
@@ -73,6 +89,24 @@ void writeUint16BE(FILE *file, uint16 x) {
 	writeByte(file, x & 0xff);
 }
 
+uint16 READ_LE_UINT16(const byte *data) {
+	return (*(data + 1) << 8) | *data;
+}
+
+uint32 READ_LE_UINT32(const byte *data) {
+	return (READ_LE_UINT16(data + 2) << 16) | READ_LE_UINT16(data);
+}
+
+void WRITE_LE_UINT16(byte *data, uint16 x) {
+	data[0] = x & 0xff;
+	data[1] = x >> 8;
+}
+
+void WRITE_LE_UINT32(byte *data, uint32 x) {
+	WRITE_LE_UINT16(data, x & 0xffff);
+	WRITE_LE_UINT16(data + 2, x >> 16);
+}
+
 uint32 getFileSize(FILE *file) {
 	uint32 pos = ftell(file);
 	fseek(file, 0, SEEK_END);
@@ -81,54 +115,88 @@ uint32 getFileSize(FILE *file) {
 	return size;
 }
 
-void writeBMPHeader(FILE *output, uint16 width, uint16 height, uint16 bitsPerPixel) {
-	// Main Header
-	writeUint16BE(output, 'BM');
-	writeUint32LE(output, 0); // Size, will fill in later
-	writeUint16LE(output, 0); // Reserved
-	writeUint16LE(output, 0); // Reserved
-	writeUint32LE(output, 0); // Image offset, will fill in later
-
-	// Info Header
-	writeUint32LE(output, 40);
-	writeUint32LE(output, width);
-	writeUint32LE(output, height);
-	writeUint16LE(output, 1);
-	writeUint16LE(output, bitsPerPixel);
-	writeUint32LE(output, 0);
-	writeUint32LE(output, 0); // Image size, will fill in later
-	writeUint32LE(output, 72); // 72 dpi sounds fine to me
-	writeUint32LE(output, 72); // as above
+// Read length bytes from offset in the input, zero-filling anything past
+// the end of the file. With threads, this is a positional read that leaves
+// the descriptor's offset alone, so any number of threads can read from
+// the one descriptor at once.
+void readData(FILE *input, uint32 offset, byte *data, uint32 length) {
+#ifdef USE_THREADS
+	while (length > 0) {
+		ssize_t count = pread(fileno(input), data, length, offset);
+		if (count <= 0)
+			break;
 
-	// Only write the empty palette if we're not in paletted mode. The
-	// palette header will be written in writeBMPPalette() otherwise.
-	if (bitsPerPixel > 8) {
-		writeUint32LE(output, 0);
-		writeUint32LE(output, 0);
+		data += count;
+		offset += count;
+		length -= count;
 	}
+#else
+	fseek(input, offset, SEEK_SET);
+	uint32 count = fread(data, 1, length, input);
+	data += count;
+	length -= count;
+#endif
+
+	memset(data, 0, length);
 }
 
-void fillBMPHeaderValues(FILE *output, uint32 imageOffset, uint32 imageSize) {
-	fflush(output);
-	uint32 fileSize = getFileSize(output);
+// Constants
+enum {
+	kPicTableOffset = 12, // Offset of the PicEntry table in the file
+	kPicEntrySize = 48, // Size of a PicEntry in the file
+	kIndexHeaderSize = 20, // Size of the sidecar index header
+	kIndexVersion = 1,
+	kBMPHeaderSize = 54,
+	kBMPCompressionRGB = 0,
+	kBMPCompressionBitfields = 3,
+	kBMPBitfieldsHeaderSize = 66, // Headers plus the three color masks
+	kAtlasGutter = 2, // Space around each thumbnail in an atlas
+	kAtlasBackground = 0x40, // Gray
+	kDefaultThumbnailSize = 128
+};
 
-	fseek(output, 2, SEEK_SET);
-	fflush(output);
-	writeUint32LE(output, fileSize);
-	fflush(output);
+uint32 getBMPPitch(uint32 width, uint16 bitsPerPixel) {
+	return (width * (bitsPerPixel >> 3) + 3) & ~3;
+}
 
-	fseek(output, 10, SEEK_SET);
-	fflush(output);
-	writeUint32LE(output, imageOffset);
-	fflush(output);
+// Build the BMP headers in memory for imageSize bytes of pixel data and
+// return the offset of that data
+uint32 writeBMPHeader(byte *data, uint32 width, uint32 height, uint16 bitsPerPixel, uint32 compression, uint32 imageSize) {
+	uint32 imageOffset = (compression == kBMPCompressionBitfields) ? kBMPBitfieldsHeaderSize : kBMPHeaderSize;
 
-	fseek(output, 34, SEEK_SET);
-	fflush(output);
-	writeUint32LE(output, imageSize);
+	// Main Header
+	data[0] = 'B';
+	data[1] = 'M';
+	WRITE_LE_UINT32(data + 2, imageOffset + imageSize);
+	WRITE_LE_UINT32(data + 6, 0); // Reserved
+	WRITE_LE_UINT32(data + 10, imageOffset);
+
+	// Info Header
+	WRITE_LE_UINT32(data + 14, 40);
+	WRITE_LE_UINT32(data + 18, width);
+	WRITE_LE_UINT32(data + 22, height);
+	WRITE_LE_UINT16(data + 26, 1);
+	WRITE_LE_UINT16(data + 28, bitsPerPixel);
+	WRITE_LE_UINT32(data + 30, compression);
+	WRITE_LE_UINT32(data + 34, imageSize);
+	WRITE_LE_UINT32(data + 38, 72); // 72 dpi sounds fine to me
+	WRITE_LE_UINT32(data + 42, 72); // as above
+	WRITE_LE_UINT32(data + 46, 0);
+	WRITE_LE_UINT32(data + 50, 0);
+
+	// BI_BITFIELDS images are always rgb555 here; the masks follow the
+	// info header
+	if (compression == kBMPCompressionBitfields) {
+		WRITE_LE_UINT32(data + 54, 0x7c00);
+		WRITE_LE_UINT32(data + 58, 0x03e0);
+		WRITE_LE_UINT32(data + 62, 0x001f);
+	}
+
+	return imageOffset;
 }
 
 struct PicEntry {
-	char filename[32];
+	char filename[33]; // 32 in the file, plus a terminator
 	uint32 width;
 	uint32 height;
 	uint32 length;
@@ -150,128 +218,1263 @@ inline byte isolateBlueChannel(uint16 color) {
 }
 
 
-// NOTE: Original format is rgb555
-bool extractImageToBMP(FILE *input, FILE *output, PicEntry &entry) {
-	fseek(input, entry.offset, SEEK_SET);
+uint32 getBMPSize(uint32 width, uint32 height, bool keepRGB555) {
+	uint32 headerSize = keepRGB555 ? kBMPBitfieldsHeaderSize : kBMPHeaderSize;
+	return headerSize + getBMPPitch(width, keepRGB555 ? 16 : 24) * height;
+}
 
-	printf("Width = %d\n", entry.width);
-	printf("Height = %d\n", entry.height);
+// Convert rgb555 pixels to a complete BMP file in memory and return its
+// size. The image is either expanded to 24bpp or kept as it is in a 16bpp
+// BI_BITFIELDS image, in which case only the row order and padding change.
+uint32 convertImageToBMP(const byte *pixels, uint32 width, uint32 height, bool keepRGB555, byte *bmp) {
+	uint16 bitsPerPixel = keepRGB555 ? 16 : 24;
+	uint32 compression = keepRGB555 ? kBMPCompressionBitfields : kBMPCompressionRGB;
+	uint32 pitch = getBMPPitch(width, bitsPerPixel);
+	uint32 rowSize = width * (bitsPerPixel >> 3);
+	uint32 imageOffset = writeBMPHeader(bmp, width, height, bitsPerPixel, compression, pitch * height);
 
-	if (entry.width * entry.height * 2 != entry.length) {
-		printf("Image entry has bad length %08x, %08x\n", entry.length, entry.offset);
-		return false;
+	for (uint32 y = 0; y < height; y++) {
+		const byte *src = pixels + y * width * 2;
+		byte *dst = bmp + imageOffset + (height - 1 - y) * pitch;
+
+		if (keepRGB555) {
+			memcpy(dst, src, rowSize);
+		} else {
+			for (uint32 x = 0; x < width; x++) {
+				uint16 color = READ_LE_UINT16(src + x * 2);
+				dst[x * 3] = isolateBlueChannel(color);
+				dst[x * 3 + 1] = isolateGreenChannel(color);
+				dst[x * 3 + 2] = isolateRedChannel(color);
+			}
+		}
+
+		memset(dst + rowSize, 0, pitch - rowSize);
 	}
 
-	uint16 *pixels = new uint16[entry.width * entry.height];
-	for (uint32 i = 0; i < entry.width * entry.height; i++)
-		pixels[i] = readUint16LE(input);
+	return imageOffset + pitch * height;
+}
 
-	writeBMPHeader(output, entry.width, entry.height, 24);
+// Whether the entry's length matches its dimensions. The product is taken
+// in 64 bits so huge dimensions can't wrap around to a matching length.
+bool hasValidLength(const PicEntry &entry) {
+	return (unsigned long long)entry.width * entry.height * 2 == entry.length;
+}
 
-	const uint32 pitch = entry.width * 3;
-	const int extraDataLength = (pitch % 4) ? 4 - (pitch % 4) : 0;
+// NOTE: Original format is rgb555
+// The pixels and bmp buffers must hold the entry's data and its BMP file
+bool extractImageToBMP(FILE *input, FILE *output, const PicEntry &entry, bool keepRGB555, byte *pixels, byte *bmp) {
+	readData(input, entry.offset, pixels, entry.length);
 
-	for (int y = entry.height - 1; y >= 0; y--) {
-		for (int x = 0; x < entry.width; x++) {
-			uint16 color = pixels[x + entry.width * y];
-			writeByte(output, isolateBlueChannel(color));
-			writeByte(output, isolateGreenChannel(color));
-			writeByte(output, isolateRedChannel(color));
-		}
+	uint32 size = convertImageToBMP(pixels, entry.width, entry.height, keepRGB555, bmp);
+	return fwrite(bmp, 1, size, output) == size;
+}
 
-		for (int i = 0; i < extraDataLength; i++)
-			writeByte(output, 0);
-	}
+static const PicEntry *s_sortEntries = 0;
+
+int compareEntryOffsets(const void *a, const void *b) {
+	uint32 offsetA = s_sortEntries[*(const uint32 *)a].offset;
+	uint32 offsetB = s_sortEntries[*(const uint32 *)b].offset;
+	return (offsetA < offsetB) ? -1 : (offsetA > offsetB) ? 1 : 0;
+}
 
-	fillBMPHeaderValues(output, 54, (pitch + extraDataLength) * entry.height);
+// Get the entry numbers sorted by where their data is stored, so the
+// archive is only ever read forwards
+uint32 *getEntryOrder(const PicEntry *entries, uint32 fileCount) {
+	uint32 *order = new uint32[fileCount];
+	for (uint32 i = 0; i < fileCount; i++)
+		order[i] = i;
 
-	delete[] pixels;
-	return true;
+	s_sortEntries = entries;
+	qsort(order, fileCount, sizeof(uint32), compareEntryOffsets);
+	return order;
 }
 
-bool extractAllFiles(FILE *input) {
+// Read the raw PicEntry table from the start of the archive
+byte *readPicTable(FILE *input, uint32 &fileCount) {
 	uint32 tag = readUint32BE(input);
 	uint32 version = readUint32LE(input);
 
 	if (tag != 'PICS') {
 		printf("PICS tag not found\n");
-		return false;
+		return 0;
 	}
 
 	if (version != 1) {
 		printf("Unknown version %d", version);
-		return false;
+		return 0;
+	}
+
+	fileCount = readUint32LE(input);
+
+	// Make sure the table fits in the archive before allocating it
+	uint32 fileSize = getFileSize(input);
+	if (fileSize < kPicTableOffset || fileCount > (fileSize - kPicTableOffset) / kPicEntrySize) {
+		printf("Picture table is truncated\n");
+		return 0;
+	}
+
+	byte *table = new byte[fileCount * kPicEntrySize];
+	if (fread(table, kPicEntrySize, fileCount, input) != fileCount) {
+		printf("Picture table is truncated\n");
+		delete[] table;
+		return 0;
 	}
 
+	return table;
+}
 
-	uint32 fileCount = readUint32LE(input);
+PicEntry *decodePicTable(const byte *table, uint32 fileCount) {
 	PicEntry *entries = new PicEntry[fileCount];
 
 	for (uint32 i = 0; i < fileCount; i++) {
-		fread(entries[i].filename, 1, 32, input);
-		entries[i].width = readUint32LE(input);
-		entries[i].height = readUint32LE(input);
-		entries[i].length = readUint32LE(input);
-		entries[i].offset = readUint32LE(input);
+		const byte *record = table + i * kPicEntrySize;
+		memcpy(entries[i].filename, record, 32);
+		entries[i].filename[32] = 0;
+		entries[i].width = READ_LE_UINT32(record + 32);
+		entries[i].height = READ_LE_UINT32(record + 36);
+		entries[i].length = READ_LE_UINT32(record + 40);
+		entries[i].offset = READ_LE_UINT32(record + 44);
 	}
 
-	bool allDone = true;
+	return entries;
+}
+
+// The sidecar index (<archive>.idx) is a copy of the raw picture table
+// behind a small header holding the archive's size and modification time.
+// If either no longer matches, the index is stale and the archive is parsed
+// again.
+
+bool getArchiveStamp(const char *filename, uint32 &size, uint32 &mtime) {
+	struct stat status;
+	if (stat(filename, &status) != 0)
+		return false;
+
+	size = status.st_size;
+	mtime = status.st_mtime;
+	return true;
+}
+
+char *getIndexFilename(const char *filename) {
+	char *indexName = new char[strlen(filename) + 5];
+	strcpy(indexName, filename);
+	strcat(indexName, ".idx");
+	return indexName;
+}
+
+byte *readSidecarIndex(const char *indexName, uint32 size, uint32 mtime, uint32 &fileCount) {
+	FILE *file = fopen(indexName, "rb");
+	if (!file)
+		return 0;
+
+	byte header[kIndexHeaderSize];
+	byte *table = 0;
+
+	if (fread(header, 1, kIndexHeaderSize, file) == kIndexHeaderSize && !memcmp(header, "PIXI", 4)
+			&& READ_LE_UINT32(header + 4) == kIndexVersion && READ_LE_UINT32(header + 8) == size
+			&& READ_LE_UINT32(header + 12) == mtime) {
+		fileCount = READ_LE_UINT32(header + 16);
+
+		// Check the count against the size first so the product can't wrap
+		uint32 fileSize = getFileSize(file);
+		uint32 maxCount = (fileSize - kIndexHeaderSize) / kPicEntrySize;
+
+		if (fileCount <= maxCount && fileSize == kIndexHeaderSize + fileCount * kPicEntrySize) {
+			table = new byte[fileCount * kPicEntrySize];
+
+			if (fread(table, kPicEntrySize, fileCount, file) != fileCount) {
+				delete[] table;
+				table = 0;
+			}
+		}
+	}
+
+	fclose(file);
+	return table;
+}
+
+bool writeSidecarIndex(const char *indexName, uint32 size, uint32 mtime, const byte *table, uint32 fileCount) {
+	FILE *file = fopen(indexName, "wb");
+	if (!file)
+		return false;
+
+	byte header[kIndexHeaderSize];
+	memcpy(header, "PIXI", 4);
+	WRITE_LE_UINT32(header + 4, kIndexVersion);
+	WRITE_LE_UINT32(header + 8, size);
+	WRITE_LE_UINT32(header + 12, mtime);
+	WRITE_LE_UINT32(header + 16, fileCount);
+
+	bool written = fwrite(header, 1, kIndexHeaderSize, file) == kIndexHeaderSize
+			&& fwrite(table, kPicEntrySize, fileCount, file) == fileCount;
+
+	fclose(file);
+	return written;
+}
+
+// Name lookup: an open-addressed hash table (FNV-1a, linear probing) of
+// entry numbers by filename, plus glob matching for patterns
+
+struct NameIndex {
+	uint32 *slots; // Entry number + 1, or 0 when empty
+	uint32 mask; // Slot count - 1; the count is a power of two
+};
+
+uint32 hashName(const char *name) {
+	uint32 hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (byte)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+void buildNameIndex(NameIndex &index, const PicEntry *entries, uint32 fileCount) {
+	// Keep the table at most half full
+	uint32 slotCount = 16;
+	while (slotCount < fileCount * 2)
+		slotCount <<= 1;
+
+	index.slots = new uint32[slotCount];
+	index.mask = slotCount - 1;
+	memset(index.slots, 0, slotCount * sizeof(uint32));
 
 	for (uint32 i = 0; i < fileCount; i++) {
-		char *filename = new char[strlen(entries[i].filename) + 5];
-		memset(filename, 0, strlen(entries[i].filename) + 5);
-		strcpy(filename, entries[i].filename);
+		uint32 slot = hashName(entries[i].filename) & index.mask;
+
+		while (index.slots[slot] != 0)
+			slot = (slot + 1) & index.mask;
+
+		index.slots[slot] = i + 1;
+	}
+}
+
+// Match a name against a pattern where * matches any run of characters and
+// ? matches any single one
+bool matchGlob(const char *pattern, const char *name) {
+	const char *star = 0;
+	const char *starName = 0;
+
+	while (*name) {
+		if (*pattern == '?' || *pattern == *name) {
+			pattern++;
+			name++;
+		} else if (*pattern == '*') {
+			star = pattern++;
+			starName = name;
+		} else if (star) {
+			pattern = star + 1;
+			name = ++starName;
+		} else {
+			return false;
+		}
+	}
+
+	while (*pattern == '*')
+		pattern++;
+
+	return *pattern == 0;
+}
+
+// Mark every entry matching a name or pattern as selected. Plain names
+// (which may appear more than once) come from the hash table; patterns such
+// as "ui_*" are matched against each name. Returns the number of matches.
+uint32 selectPictures(const NameIndex &index, const PicEntry *entries, uint32 fileCount, const char *pattern, bool *selected) {
+	uint32 matches = 0;
+
+	if (strpbrk(pattern, "*?")) {
+		for (uint32 i = 0; i < fileCount; i++) {
+			if (matchGlob(pattern, entries[i].filename)) {
+				selected[i] = true;
+				matches++;
+			}
+		}
+
+		return matches;
+	}
+
+	for (uint32 slot = hashName(pattern) & index.mask; index.slots[slot] != 0; slot = (slot + 1) & index.mask) {
+		uint32 i = index.slots[slot] - 1;
+
+		if (!strcmp(entries[i].filename, pattern)) {
+			selected[i] = true;
+			matches++;
+		}
+	}
+
+	return matches;
+}
+
+void printJSONString(FILE *file, const char *str) {
+	fputc('"', file);
+
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(file, "\\%c", *str);
+		else if ((byte)*str < 0x20)
+			fprintf(file, "\\u%04x", (byte)*str);
+		else
+			fputc(*str, file);
+	}
+
+	fputc('"', file);
+}
+
+void listPictures(const PicEntry *entries, uint32 fileCount, const bool *selected, bool json) {
+	if (json)
+		printf("[\n");
+	else
+		printf("%-32s %6s %6s %10s %10s\n", "Name", "Width", "Height", "Offset", "Size");
+
+	bool first = true;
+
+	for (uint32 i = 0; i < fileCount; i++) {
+		if (selected && !selected[i])
+			continue;
+
+		const PicEntry &entry = entries[i];
+
+		if (json) {
+			printf("%s\t{\"name\": ", first ? "" : ",\n");
+			printJSONString(stdout, entry.filename);
+			printf(", \"width\": %u, \"height\": %u, \"offset\": %u, \"size\": %u}",
+					entry.width, entry.height, entry.offset, entry.length);
+		} else {
+			printf("%-32s %6u %6u %10u %10u\n", entry.filename, entry.width, entry.height, entry.offset, entry.length);
+		}
+
+		first = false;
+	}
+
+	if (json)
+		printf("%s]\n", first ? "" : "\n");
+}
+
+// Load an uncompressed 24-bit or 32-bit BMP, or a 16-bit rgb555 one, as
+// top-down rgb555 pixels. 16-bit pixels are kept as they are, so BMPs made
+// with --16bpp go back in unchanged.
+byte *loadBMP(FILE *input, uint32 &width, uint32 &height) {
+	if (readUint16BE(input) != 'BM') {
+		printf("BM tag not found\n");
+		return 0;
+	}
+
+	readUint32LE(input); // File size
+	readUint32LE(input); // Reserved
+	uint32 imageOffset = readUint32LE(input);
+	uint32 headerSize = readUint32LE(input);
+	int bmpWidth = (int)readUint32LE(input);
+	int bmpHeight = (int)readUint32LE(input);
+	readUint16LE(input); // Planes
+	uint16 bitsPerPixel = readUint16LE(input);
+	uint32 compression = readUint32LE(input);
+
+	if (headerSize < 40) {
+		printf("Unsupported BMP header size %d\n", headerSize);
+		return 0;
+	}
+
+	if (bitsPerPixel != 16 && bitsPerPixel != 24 && bitsPerPixel != 32) {
+		printf("Unsupported BMP depth %d\n", bitsPerPixel);
+		return 0;
+	}
+
+	if (compression == kBMPCompressionBitfields && bitsPerPixel == 16) {
+		// The masks follow the 40-byte part of the info header
+		fseek(input, 54, SEEK_SET);
+		uint32 redMask = readUint32LE(input);
+		uint32 greenMask = readUint32LE(input);
+		uint32 blueMask = readUint32LE(input);
+
+		if (redMask != 0x7c00 || greenMask != 0x03e0 || blueMask != 0x001f) {
+			printf("Only rgb555 16-bit BMPs are supported\n");
+			return 0;
+		}
+	} else if (compression != kBMPCompressionRGB && !(compression == kBMPCompressionBitfields && bitsPerPixel == 32)) {
+		// BI_BITFIELDS is fine for 32bpp as long as it's the usual BGRA layout
+		printf("Compressed BMPs are not supported\n");
+		return 0;
+	}
+
+	// Negative height means top-down
+	bool topDown = bmpHeight < 0;
+	if (topDown)
+		bmpHeight = -bmpHeight;
+
+	if (bmpWidth <= 0 || bmpHeight == 0 || bmpWidth > 0xffff || bmpHeight > 0xffff) {
+		printf("Bad BMP dimensions %dx%d\n", bmpWidth, bmpHeight);
+		return 0;
+	}
+
+	// The archive stores the data length in 32 bits
+	if ((unsigned long long)bmpWidth * bmpHeight * 2 > 0xffffffff) {
+		printf("BMP is too large: %dx%d\n", bmpWidth, bmpHeight);
+		return 0;
+	}
+
+	width = bmpWidth;
+	height = bmpHeight;
+
+	const uint32 bytesPerPixel = bitsPerPixel >> 3;
+	const uint32 pitch = getBMPPitch(width, bitsPerPixel);
+	byte *row = new byte[pitch];
+	byte *pixels = new byte[width * height * 2];
+
+	fseek(input, imageOffset, SEEK_SET);
+
+	for (uint32 y = 0; y < height; y++) {
+		if (fread(row, 1, pitch, input) != pitch) {
+			printf("Failed to read BMP row %d\n", y);
+			delete[] row;
+			delete[] pixels;
+			return 0;
+		}
+
+		byte *dst = pixels + (topDown ? y : height - 1 - y) * width * 2;
+
+		if (bitsPerPixel == 16) {
+			memcpy(dst, row, width * 2);
+			continue;
+		}
+
+		for (uint32 x = 0; x < width; x++) {
+			const byte *pixel = row + x * bytesPerPixel;
+			WRITE_LE_UINT16(dst + x * 2, ((pixel[2] >> 3) << 10) | ((pixel[1] >> 3) << 5) | (pixel[0] >> 3));
+		}
+	}
+
+	delete[] row;
+	return pixels;
+}
+
+// Replace the pixels of entry number index and update its table record.
+// The new data overwrites the old slot if it fits there without touching
+// another entry's data, and is appended to the archive otherwise. Nothing
+// else in the archive is rewritten.
+bool replacePicture(FILE *archive, PicEntry *entries, uint32 fileCount, uint32 index, const byte *pixels, uint32 width, uint32 height) {
+	PicEntry &entry = entries[index];
+	unsigned long long fullLength = (unsigned long long)width * height * 2;
+	if (fullLength > 0xffffffff) {
+		printf("Picture is too large: %dx%d\n", width, height);
+		return false;
+	}
+
+	uint32 length = (uint32)fullLength;
+	bool inPlace = length <= entry.length;
+
+	for (uint32 i = 0; i < fileCount && inPlace; i++) {
+		if (i != index && entries[i].length != 0 && entries[i].offset < (unsigned long long)entry.offset + length
+				&& entry.offset < (unsigned long long)entries[i].offset + entries[i].length)
+			inPlace = false;
+	}
+
+	uint32 offset = entry.offset;
+	if (!inPlace) {
+		fseek(archive, 0, SEEK_END);
+		offset = ftell(archive);
+	}
+
+	fseek(archive, offset, SEEK_SET);
+	if (fwrite(pixels, 1, length, archive) != length) {
+		printf("Failed to write the picture data\n");
+		return false;
+	}
+
+	byte record[16];
+	WRITE_LE_UINT32(record, width);
+	WRITE_LE_UINT32(record + 4, height);
+	WRITE_LE_UINT32(record + 8, length);
+	WRITE_LE_UINT32(record + 12, offset);
+
+	fseek(archive, kPicTableOffset + index * kPicEntrySize + 32, SEEK_SET);
+	if (fwrite(record, 1, sizeof(record), archive) != sizeof(record)) {
+		printf("Failed to update the picture table\n");
+		return false;
+	}
+
+	printf("%s %s (%dx%d) at %08x\n", inPlace ? "Replaced" : "Appended", entry.filename, width, height, offset);
+
+	entry.width = width;
+	entry.height = height;
+	entry.length = length;
+	entry.offset = offset;
+	return true;
+}
+
+bool replacePictureFromBMP(FILE *archive, PicEntry *entries, uint32 fileCount, const char *name, const char *bmpName) {
+	// Exact names only; wildcards are not expanded here
+	uint32 index = fileCount;
+	uint32 matches = 0;
+
+	for (uint32 i = 0; i < fileCount; i++) {
+		if (!strcmp(entries[i].filename, name)) {
+			index = i;
+			matches++;
+		}
+	}
+
+	if (matches != 1) {
+		printf(matches ? "More than one picture is named '%s'\n" : "No picture named '%s'\n", name);
+		return false;
+	}
+
+	FILE *input = fopen(bmpName, "rb");
+	if (!input) {
+		printf("Could not open '%s' for reading\n", bmpName);
+		return false;
+	}
+
+	uint32 width, height;
+	byte *pixels = loadBMP(input, width, height);
+	fclose(input);
+
+	if (!pixels)
+		return false;
+
+	bool result = replacePicture(archive, entries, fileCount, index, pixels, width, height);
+	delete[] pixels;
+	return result;
+}
+
+uint32 getThreadCount(uint32 jobCount) {
+	uint32 threadCount = 1;
+
+#ifdef USE_THREADS
+	long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpuCount > 1)
+		threadCount = cpuCount;
+#endif
+
+	return (threadCount < jobCount) ? threadCount : (jobCount ? jobCount : 1);
+}
+
+// Run the worker on jobCount jobs' worth of threads and wait for them all.
+// This thread works through the jobs alongside the extra ones.
+void runWorkers(void *(*worker)(void *), void *context, uint32 jobCount) {
+#ifdef USE_THREADS
+	uint32 extraThreads = getThreadCount(jobCount) - 1;
+	pthread_t *threads = new pthread_t[extraThreads + 1];
+	uint32 started = 0;
+
+	for (; started < extraThreads; started++)
+		if (pthread_create(&threads[started], 0, worker, context) != 0)
+			break;
+
+	worker(context);
+
+	for (uint32 i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+
+	delete[] threads;
+#else
+	(void)jobCount;
+	worker(context);
+#endif
+}
+
+// Contact sheets: every selected picture is shrunk to fit a square
+// thumbnail, the thumbnails are packed onto shelves of one 24bpp BMP, and a
+// JSON file maps each name to its rectangle
+
+struct AtlasRect {
+	uint32 x;
+	uint32 y;
+	uint32 width;
+	uint32 height;
+};
+
+void getThumbnailSize(const PicEntry &entry, uint32 maxSize, AtlasRect &rect) {
+	rect.width = entry.width;
+	rect.height = entry.height;
+
+	// Only ever shrink, keeping the aspect ratio
+	if (rect.width > maxSize && rect.width >= rect.height) {
+		rect.height = (rect.height * maxSize + rect.width / 2) / rect.width;
+		rect.width = maxSize;
+	} else if (rect.height > maxSize) {
+		rect.width = (rect.width * maxSize + rect.height / 2) / rect.height;
+		rect.height = maxSize;
+	}
+
+	if (rect.width == 0)
+		rect.width = 1;
+	if (rect.height == 0)
+		rect.height = 1;
+}
+
+static const AtlasRect *s_sortRects = 0;
+
+int compareRectHeights(const void *a, const void *b) {
+	uint32 indexA = *(const uint32 *)a;
+	uint32 indexB = *(const uint32 *)b;
+	const AtlasRect &rectA = s_sortRects[indexA];
+	const AtlasRect &rectB = s_sortRects[indexB];
+
+	if (rectA.height != rectB.height)
+		return (rectA.height > rectB.height) ? -1 : 1;
+	if (rectA.width != rectB.width)
+		return (rectA.width > rectB.width) ? -1 : 1;
+
+	return (indexA < indexB) ? -1 : (indexA > indexB) ? 1 : 0;
+}
+
+// Place the used rectangles left to right on shelves, tallest first, in an
+// atlas of the given width. Returns the height the atlas needs.
+uint32 packShelves(AtlasRect *rects, const bool *used, uint32 fileCount, uint32 atlasWidth) {
+	uint32 *order = new uint32[fileCount];
+	uint32 count = 0;
+
+	for (uint32 i = 0; i < fileCount; i++)
+		if (used[i])
+			order[count++] = i;
+
+	s_sortRects = rects;
+	qsort(order, count, sizeof(uint32), compareRectHeights);
+
+	uint32 x = kAtlasGutter;
+	uint32 y = kAtlasGutter;
+	uint32 shelfHeight = 0;
+
+	for (uint32 n = 0; n < count; n++) {
+		AtlasRect &rect = rects[order[n]];
+
+		if (x + rect.width + kAtlasGutter > atlasWidth) {
+			x = kAtlasGutter;
+			y += shelfHeight + kAtlasGutter;
+			shelfHeight = 0;
+		}
+
+		rect.x = x;
+		rect.y = y;
+		x += rect.width + kAtlasGutter;
+
+		if (rect.height > shelfHeight)
+			shelfHeight = rect.height;
+	}
+
+	delete[] order;
+	return y + shelfHeight + kAtlasGutter;
+}
+
+// Add up the channels of the source pixels in columns x0 to x1 of rows y0
+// to y1
+inline void sumBlockChannels(const byte *pixels, uint32 srcWidth, uint32 x0, uint32 x1, uint32 y0, uint32 y1, uint32 &red, uint32 &green, uint32 &blue) {
+	red = green = blue = 0;
+	uint32 sx0 = x0;
+
+#ifdef __SSE2__
+	// Only worth it for blocks at least eight pixels wide. Multiplying by
+	// one widens the channels to 32 bits in pairs.
+	if (x1 - x0 >= 8) {
+		const __m128i channelMask = _mm_set1_epi16(0x1f);
+		const __m128i ones = _mm_set1_epi16(1);
+		__m128i redSum = _mm_setzero_si128();
+		__m128i greenSum = _mm_setzero_si128();
+		__m128i blueSum = _mm_setzero_si128();
+		uint32 sx1 = x1 - (x1 - x0) % 8;
+
+		for (uint32 sy = y0; sy < y1; sy++) {
+			const byte *src = pixels + (sy * srcWidth + x0) * 2;
+
+			for (uint32 sx = x0; sx < sx1; sx += 8, src += 16) {
+				__m128i colors = _mm_loadu_si128((const __m128i *)src);
+				redSum = _mm_add_epi32(redSum, _mm_madd_epi16(_mm_and_si128(_mm_srli_epi16(colors, 10), channelMask), ones));
+				greenSum = _mm_add_epi32(greenSum, _mm_madd_epi16(_mm_and_si128(_mm_srli_epi16(colors, 5), channelMask), ones));
+				blueSum = _mm_add_epi32(blueSum, _mm_madd_epi16(_mm_and_si128(colors, channelMask), ones));
+			}
+		}
+
+		uint32 parts[4];
+		_mm_storeu_si128((__m128i *)parts, redSum);
+		red = parts[0] + parts[1] + parts[2] + parts[3];
+		_mm_storeu_si128((__m128i *)parts, greenSum);
+		green = parts[0] + parts[1] + parts[2] + parts[3];
+		_mm_storeu_si128((__m128i *)parts, blueSum);
+		blue = parts[0] + parts[1] + parts[2] + parts[3];
+		sx0 = sx1;
+	}
+#endif
+
+	for (uint32 sy = y0; sy < y1; sy++) {
+		const byte *src = pixels + (sy * srcWidth + sx0) * 2;
+
+		for (uint32 sx = sx0; sx < x1; sx++, src += 2) {
+			uint16 color = READ_LE_UINT16(src);
+			red += (color >> 10) & 0x1f;
+			green += (color >> 5) & 0x1f;
+			blue += color & 0x1f;
+		}
+	}
+}
+
+// Box-filter rgb555 pixels down to width x height 24bpp pixels. Each output
+// pixel averages the block of source pixels it covers; at full size this
+// gives the same colors as a normal extraction. pitch may be negative for
+// bottom-up images.
+void drawThumbnail(const byte *pixels, uint32 srcWidth, uint32 srcHeight, byte *dst, int pitch, uint32 width, uint32 height) {
+	for (uint32 y = 0; y < height; y++) {
+		uint32 y0 = y * srcHeight / height;
+		uint32 y1 = (y + 1) * srcHeight / height;
+		byte *row = dst + (int)y * pitch;
+
+		for (uint32 x = 0; x < width; x++) {
+			uint32 x0 = x * srcWidth / width;
+			uint32 x1 = (x + 1) * srcWidth / width;
+			uint32 red, green, blue;
+			sumBlockChannels(pixels, srcWidth, x0, x1, y0, y1, red, green, blue);
+
+			uint32 count = (y1 - y0) * (x1 - x0);
+			row[x * 3] = (blue << 3) / count;
+			row[x * 3 + 1] = (green << 3) / count;
+			row[x * 3 + 2] = (red << 3) / count;
+		}
+	}
+}
+
+bool writeAtlasMap(const char *filename, const PicEntry *entries, const AtlasRect *rects, const bool *used, uint32 fileCount) {
+	FILE *output = fopen(filename, "w");
+	if (!output)
+		return false;
+
+	fprintf(output, "[\n");
+	bool first = true;
+
+	for (uint32 i = 0; i < fileCount; i++) {
+		if (!used[i])
+			continue;
+
+		fprintf(output, "%s\t{\"name\": ", first ? "" : ",\n");
+		printJSONString(output, entries[i].filename);
+		fprintf(output, ", \"x\": %u, \"y\": %u, \"width\": %u, \"height\": %u, \"sourceWidth\": %u, \"sourceHeight\": %u}",
+				rects[i].x, rects[i].y, rects[i].width, rects[i].height, entries[i].width, entries[i].height);
+		first = false;
+	}
+
+	fprintf(output, "%s]\n", first ? "" : "\n");
+	fclose(output);
+	return true;
+}
+
+// The thumbnails to draw into an atlas. Each picture has its own rectangle
+// of the atlas, so the workers draw straight into it without a lock.
+struct AtlasContext {
+	FILE *input; ///< Only ever read with readData()
+	const PicEntry *entries;
+	const AtlasRect *rects;
+	const uint32 *jobs; ///< Entry numbers, in archive order
+	uint32 jobCount;
+	uint32 nextJob;
+	uint32 maxLength; ///< Enough for the biggest picture's pixels
+	byte *image; ///< The atlas rows, bottom-up
+	uint32 pitch;
+	uint32 height;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+bool takeThumbnail(AtlasContext &context, uint32 &index) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&context.lock);
+#endif
+
+	index = context.nextJob;
+	bool found = index < context.jobCount;
+	if (found)
+		context.nextJob++;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&context.lock);
+#endif
+
+	return found;
+}
+
+void *atlasWorker(void *arg) {
+	AtlasContext &context = *(AtlasContext *)arg;
+	byte *pixels = new byte[context.maxLength];
+	uint32 index;
+
+	while (takeThumbnail(context, index)) {
+		uint32 i = context.jobs[index];
+		const PicEntry &entry = context.entries[i];
+		const AtlasRect &rect = context.rects[i];
+
+		readData(context.input, entry.offset, pixels, entry.length);
+
+		byte *dst = context.image + (context.height - 1 - rect.y) * context.pitch + rect.x * 3;
+		drawThumbnail(pixels, entry.width, entry.height, dst, -(int)context.pitch, rect.width, rect.height);
+	}
+
+	delete[] pixels;
+	return 0;
+}
+
+void drawAllThumbnails(AtlasContext &context) {
+#ifdef USE_THREADS
+	pthread_mutex_init(&context.lock, 0);
+#endif
+
+	runWorkers(atlasWorker, &context, context.jobCount);
+
+#ifdef USE_THREADS
+	pthread_mutex_destroy(&context.lock);
+#endif
+}
+
+bool writeAtlas(FILE *input, const PicEntry *entries, uint32 fileCount, const bool *selected, const char *atlasName, uint32 thumbnailSize) {
+	AtlasRect *rects = new AtlasRect[fileCount];
+	bool *used = new bool[fileCount];
+	uint32 usedCount = 0;
+	uint32 maxLength = 0;
+	uint32 widest = 0;
+	double area = 0.0;
+
+	for (uint32 i = 0; i < fileCount; i++) {
+		used[i] = (!selected || selected[i]) && entries[i].width != 0 && entries[i].height != 0
+				&& hasValidLength(entries[i]);
+
+		if (!used[i]) {
+			if (!selected || selected[i])
+				printf("Skipping %s: bad image entry\n", entries[i].filename);
+			continue;
+		}
+
+		getThumbnailSize(entries[i], thumbnailSize, rects[i]);
+		area += (double)(rects[i].width + kAtlasGutter) * (rects[i].height + kAtlasGutter);
+		usedCount++;
+
+		if (rects[i].width > widest)
+			widest = rects[i].width;
+		if (entries[i].length > maxLength)
+			maxLength = entries[i].length;
+	}
+
+	if (usedCount == 0) {
+		printf("No pictures to put in the atlas\n");
+		delete[] rects;
+		delete[] used;
+		return false;
+	}
+
+	// Aim for a roughly square sheet
+	uint32 atlasWidth = (uint32)ceil(sqrt(area)) + kAtlasGutter;
+	if (atlasWidth < widest + kAtlasGutter * 2)
+		atlasWidth = widest + kAtlasGutter * 2;
+
+	uint32 atlasHeight = packShelves(rects, used, fileCount, atlasWidth);
+	printf("Atlas is %dx%d with %d pictures\n", atlasWidth, atlasHeight, usedCount);
+
+	uint32 pitch = getBMPPitch(atlasWidth, 24);
+	uint32 bmpSize = getBMPSize(atlasWidth, atlasHeight, false);
+	byte *bmp = new byte[bmpSize];
+	uint32 imageOffset = writeBMPHeader(bmp, atlasWidth, atlasHeight, 24, kBMPCompressionRGB, pitch * atlasHeight);
+	memset(bmp + imageOffset, kAtlasBackground, pitch * atlasHeight);
+
+	// Hand the pictures out in archive order so the reads still mostly move
+	// forwards, and draw each one where it was packed
+	uint32 *order = getEntryOrder(entries, fileCount);
+	uint32 jobCount = 0;
+
+	for (uint32 n = 0; n < fileCount; n++)
+		if (used[order[n]])
+			order[jobCount++] = order[n];
+
+	AtlasContext context;
+	context.input = input;
+	context.entries = entries;
+	context.rects = rects;
+	context.jobs = order;
+	context.jobCount = jobCount;
+	context.nextJob = 0;
+	context.maxLength = maxLength;
+	context.image = bmp + imageOffset;
+	context.pitch = pitch;
+	context.height = atlasHeight;
+
+	drawAllThumbnails(context);
+	delete[] order;
+
+	bool success = false;
+	FILE *output = fopen(atlasName, "wb");
+
+	if (!output) {
+		printf("Could not open '%s' for writing\n", atlasName);
+	} else {
+		success = fwrite(bmp, 1, bmpSize, output) == bmpSize;
+		fclose(output);
+
+		char *mapName = new char[strlen(atlasName) + 6];
+		strcpy(mapName, atlasName);
+		strcat(mapName, ".json");
+
+		if (success && !writeAtlasMap(mapName, entries, rects, used, fileCount)) {
+			printf("Could not open '%s' for writing\n", mapName);
+			success = false;
+		}
+
+		delete[] mapName;
+	}
+
+	delete[] bmp;
+	delete[] used;
+	delete[] rects;
+	return success;
+}
+
+// How far extracting a picture got. Nothing is printed while extracting;
+// the messages are printed afterwards, in archive order.
+enum ExtractStatus {
+	kStatusPending, // Never started
+	kStatusDone,
+	kStatusNoOutput,
+	kStatusBadLength,
+	kStatusWriteFailed
+};
+
+// One picture to extract. The status is filled in by whichever thread
+// picks it up.
+struct ExtractJob {
+	uint32 entry;
+	ExtractStatus status;
+};
+
+struct ExtractContext {
+	FILE *input; ///< Only ever read with readData()
+	const PicEntry *entries;
+	bool keepRGB555;
+	ExtractJob *jobs;
+	uint32 jobCount;
+	uint32 nextJob;
+	uint32 maxLength; ///< Enough for the biggest picture's pixels
+	uint32 maxBMPSize; ///< Enough for the biggest picture's BMP file
+	bool failed;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+// Once a picture has failed, no more jobs are handed out
+bool takeJob(ExtractContext &context, uint32 &index) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&context.lock);
+#endif
+
+	index = context.nextJob;
+	bool found = !context.failed && index < context.jobCount;
+	if (found)
+		context.nextJob++;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&context.lock);
+#endif
+
+	return found;
+}
+
+void stopJobs(ExtractContext &context) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&context.lock);
+#endif
+
+	context.failed = true;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&context.lock);
+#endif
+}
+
+// Keep taking pictures until there are none left. Each worker converts
+// into its own scratch buffers, and every picture goes to its own file, so
+// the workers never have to wait for each other.
+void *extractWorker(void *arg) {
+	ExtractContext &context = *(ExtractContext *)arg;
+	byte *pixels = new byte[context.maxLength];
+	byte *bmp = new byte[context.maxBMPSize];
+	uint32 index;
+
+	while (takeJob(context, index)) {
+		ExtractJob &job = context.jobs[index];
+		const PicEntry &entry = context.entries[job.entry];
+
+		char filename[sizeof(entry.filename) + 4];
+		strcpy(filename, entry.filename);
 		strcat(filename, ".bmp");
 
-		FILE *output = fopen(filename, "wb+");
+		FILE *output = fopen(filename, "wb");
+
 		if (!output) {
-			printf("Could not open '%s' for writing\n", filename);
-			allDone = false;
-			delete[] filename;
-			break;
+			job.status = kStatusNoOutput;
+		} else {
+			if (!hasValidLength(entry))
+				job.status = kStatusBadLength;
+			else if (!extractImageToBMP(context.input, output, entry, context.keepRGB555, pixels, bmp))
+				job.status = kStatusWriteFailed;
+			else
+				job.status = kStatusDone;
+
+			fclose(output);
 		}
 
-		printf("Extracting %s\n", filename);
+		if (job.status != kStatusDone)
+			stopJobs(context);
+	}
+
+	delete[] bmp;
+	delete[] pixels;
+	return 0;
+}
+
+void extractAllPictures(ExtractContext &context) {
+#ifdef USE_THREADS
+	pthread_mutex_init(&context.lock, 0);
+#endif
+
+	runWorkers(extractWorker, &context, context.jobCount);
+
+#ifdef USE_THREADS
+	pthread_mutex_destroy(&context.lock);
+#endif
+}
+
+bool extractFiles(FILE *input, const PicEntry *entries, uint32 fileCount, const bool *selected, bool keepRGB555) {
+	ExtractContext context;
+	context.input = input;
+	context.entries = entries;
+	context.keepRGB555 = keepRGB555;
+	context.jobs = new ExtractJob[fileCount];
+	context.jobCount = 0;
+	context.nextJob = 0;
+	context.maxLength = 0;
+	context.maxBMPSize = 0;
+	context.failed = false;
+
+	// Size the scratch buffers for the largest picture up front so nothing
+	// is allocated per entry. Bad entries are reported when reached. The
+	// jobs are handed out in archive order so the reads still mostly move
+	// forwards.
+	uint32 *order = getEntryOrder(entries, fileCount);
+
+	for (uint32 n = 0; n < fileCount; n++) {
+		uint32 i = order[n];
+		if (selected && !selected[i])
+			continue;
+
+		context.jobs[context.jobCount].entry = i;
+		context.jobs[context.jobCount].status = kStatusPending;
+		context.jobCount++;
+
+		if (!hasValidLength(entries[i]))
+			continue;
+
+		uint32 bmpSize = getBMPSize(entries[i].width, entries[i].height, keepRGB555);
 
-		if (!extractImageToBMP(input, output, entries[i])) {
+		if (entries[i].length > context.maxLength)
+			context.maxLength = entries[i].length;
+		if (bmpSize > context.maxBMPSize)
+			context.maxBMPSize = bmpSize;
+	}
+
+	delete[] order;
+
+	extractAllPictures(context);
+
+	// Report in archive order once everything is done
+	bool allDone = true;
+
+	for (uint32 n = 0; n < context.jobCount; n++) {
+		const ExtractJob &job = context.jobs[n];
+		const PicEntry &entry = entries[job.entry];
+
+		if (job.status == kStatusPending)
+			continue;
+
+		if (job.status == kStatusNoOutput) {
+			printf("Could not open '%s.bmp' for writing\n", entry.filename);
 			allDone = false;
-			delete[] filename;
-			break;
+			continue;
 		}
 
-		printf("\n");
+		printf("Extracting %s.bmp\n", entry.filename);
+		printf("Width = %d\n", entry.width);
+		printf("Height = %d\n", entry.height);
 
-		fflush(output);
-		fclose(output);
-		delete[] filename;
+		if (job.status == kStatusBadLength) {
+			printf("Image entry has bad length %08x, %08x\n", entry.length, entry.offset);
+			allDone = false;
+		} else if (job.status == kStatusWriteFailed) {
+			printf("Could not write '%s.bmp'\n", entry.filename);
+			allDone = false;
+		} else {
+			printf("\n");
+		}
 	}
 
-	delete[] entries;
+	delete[] context.jobs;
 	return allDone;
 }
 
 int main(int argc, const char **argv) {
-	printf("\nCC4/CC5 PIX Image Extractor\n");
-	printf("Converts files from CC4/CC5 PIX files to BMP\n");
-	printf("Written by Matthew Hoops (clone2727)\n");
-	printf("See license.txt for the license\n\n");
+	bool listEntries = false;
+	bool listJSON = false;
+	bool saveIndex = false;
+	bool keepRGB555 = false;
+	const char *replaceName = 0;
+	const char *replaceBMPName = 0;
+	const char *atlasName = 0;
+	uint32 thumbnailSize = kDefaultThumbnailSize;
+
+	int argIndex = 1;
+	for (; argIndex < argc && !strncmp(argv[argIndex], "--", 2); argIndex++) {
+		if (!strcmp(argv[argIndex], "--list")) {
+			listEntries = true;
+		} else if (!strcmp(argv[argIndex], "--json")) {
+			listEntries = true;
+			listJSON = true;
+		} else if (!strcmp(argv[argIndex], "--index")) {
+			saveIndex = true;
+		} else if (!strcmp(argv[argIndex], "--16bpp")) {
+			keepRGB555 = true;
+		} else if (!strcmp(argv[argIndex], "--replace") && argIndex + 2 < argc) {
+			replaceName = argv[++argIndex];
+			replaceBMPName = argv[++argIndex];
+		} else if (!strcmp(argv[argIndex], "--atlas") && argIndex + 1 < argc) {
+			atlasName = argv[++argIndex];
+		} else if (!strcmp(argv[argIndex], "--thumb") && argIndex + 1 < argc) {
+			thumbnailSize = atoi(argv[++argIndex]);
+
+			if (thumbnailSize == 0) {
+				printf("Bad thumbnail size '%s'\n", argv[argIndex]);
+				return 1;
+			}
+		} else {
+			printf("Unknown option '%s'\n", argv[argIndex]);
+			return 1;
+		}
+	}
+
+	// Keep listings free of the banner so they can be piped elsewhere
+	if (!listEntries) {
+		printf("\nCC4/CC5 PIX Image Extractor\n");
+		printf("Converts files from CC4/CC5 PIX files to BMP\n");
+		printf("Written by Matthew Hoops (clone2727)\n");
+		printf("See license.txt for the license\n\n");
+	}
 
-	if (argc < 2) {
-		printf("Usage: %s <input>\n", argv[0]);
+	if (argIndex >= argc) {
+		printf("Usage: %s [--list] [--json] [--index] [--16bpp]\n", argv[0]);
+		printf("       [--replace <name> <bmp>] [--atlas <bmp> [--thumb <size>]]\n");
+		printf("       <input> [name|pattern ...]\n");
+		printf("  --list   List the picture table instead of extracting\n");
+		printf("  --json   List the picture table as JSON\n");
+		printf("  --index  Save the picture table to <input>.idx for later runs\n");
+		printf("  --16bpp  Keep the rgb555 pixels in 16bpp BMPs instead of 24bpp\n");
+		printf("  --replace  Replace one picture in the archive with a BMP\n");
+		printf("  --atlas  Draw the pictures as thumbnails on one contact sheet, with a\n");
+		printf("           <bmp>.json map of where each one is\n");
+		printf("  --thumb  Largest thumbnail side for --atlas (default %d)\n", kDefaultThumbnailSize);
+		printf("Names may use * and ? wildcards, e.g. 'ui_*'\n");
 		return 0;
 	}
 
-	FILE *input = fopen(argv[1], "rb");
-	if (!input) {
-		printf("Could not open '%s' for reading\n", argv[1]);
-		return 1;
+	const char *inputName = argv[argIndex++];
+
+	uint32 archiveSize = 0, archiveTime = 0;
+	bool haveStamp = getArchiveStamp(inputName, archiveSize, archiveTime);
+	char *indexName = getIndexFilename(inputName);
+
+	// A valid index means the archive itself is only needed for extraction
+	uint32 fileCount = 0;
+	byte *table = haveStamp ? readSidecarIndex(indexName, archiveSize, archiveTime, fileCount) : 0;
+	bool indexValid = table != 0;
+
+	FILE *input = 0;
+	if (replaceName) {
+		input = fopen(inputName, "rb+");
+		if (!input) {
+			printf("Could not open '%s' for writing\n", inputName);
+			return 1;
+		}
+	} else if (!listEntries || !indexValid) {
+		input = fopen(inputName, "rb");
+		if (!input) {
+			printf("Could not open '%s' for reading\n", inputName);
+			return 1;
+		}
+	}
+
+	if (!indexValid) {
+		table = readPicTable(input, fileCount);
+		if (!table)
+			return 1;
+
+		if (saveIndex && (!haveStamp || !writeSidecarIndex(indexName, archiveSize, archiveTime, table, fileCount)))
+			printf("Could not write index '%s'\n", indexName);
+	}
+
+	PicEntry *entries = decodePicTable(table, fileCount);
+	delete[] table;
+
+	if (replaceName) {
+		bool replaced = replacePictureFromBMP(input, entries, fileCount, replaceName, replaceBMPName);
+		fclose(input);
+
+		// The table changed, and an in-place patch within the same second
+		// could slip past the size and mtime check
+		if (replaced)
+			remove(indexName);
+
+		delete[] indexName;
+		delete[] entries;
+
+		if (!replaced)
+			return 1;
+
+		printf("All Done!\n");
+		return 0;
 	}
 
-	if (!extractAllFiles(input))
+	delete[] indexName;
+
+	// Any remaining arguments select entries by name or pattern
+	bool *selected = 0;
+	if (argIndex < argc) {
+		selected = new bool[fileCount];
+		memset(selected, 0, fileCount * sizeof(bool));
+
+		NameIndex nameIndex;
+		buildNameIndex(nameIndex, entries, fileCount);
+
+		for (; argIndex < argc; argIndex++) {
+			if (selectPictures(nameIndex, entries, fileCount, argv[argIndex], selected) == 0) {
+				printf("No picture matches '%s'\n", argv[argIndex]);
+				return 1;
+			}
+		}
+
+		delete[] nameIndex.slots;
+	}
+
+	bool success = true;
+	if (listEntries)
+		listPictures(entries, fileCount, selected, listJSON);
+	else if (atlasName)
+		success = writeAtlas(input, entries, fileCount, selected, atlasName, thumbnailSize);
+	else
+		success = extractFiles(input, entries, fileCount, selected, keepRGB555);
+
+	delete[] selected;
+	delete[] entries;
+
+	if (!success)
 		return 1;
 
-	fclose(input);
+	if (input)
+		fclose(input);
+
+	if (!listEntries)
+		printf("All Done!\n");
 
-	printf("All Done!\n");
 	return 0;
 }
@@ -18,12 +18,24 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 // Standard types
 typedef unsigned char byte;
 typedef unsigned short uint16;
 typedef unsigned int uint32;
 
+// Constants
+enum {
+	kBufSize = 16384,
+	kSMFHeaderSize = 29 // MThd chunk, MTrk header and the tempo event
+};
+
 // Helper functions for reading integers from the stream (maintaining endianness)
 byte readByte(FILE *input) {
 	byte b;
@@ -83,52 +95,282 @@ uint32 getFileSize(FILE *input) {
 	return size;
 }
 
+void WRITE_BE_UINT16(byte *data, uint16 x) {
+	data[0] = x >> 8;
+	data[1] = x & 0xff;
+}
+
+void WRITE_BE_UINT24(byte *data, uint32 x) {
+	WRITE_BE_UINT16(data, x >> 8);
+	data[2] = x & 0xff;
+}
+
+void WRITE_BE_UINT32(byte *data, uint32 x) {
+	WRITE_BE_UINT16(data, x >> 16);
+	WRITE_BE_UINT16(data + 2, x & 0xffff);
+}
+
+// Copy length bytes from the current input position to the output
+void copyData(FILE *input, FILE *output, uint32 length) {
+#ifdef __linux__
+	// Have the kernel move the data straight from one file to the other.
+	// This also works when the output is a pipe.
+	fflush(output);
+	off_t offset = ftell(input);
+
+	while (length > 0) {
+		ssize_t count = sendfile(fileno(output), fileno(input), &offset, length);
+		if (count <= 0)
+			break;
+
+		length -= count;
+	}
+
+	// sendfile() doesn't touch the stdio positions, so sync them up again.
+	// Anything left over (e.g. sendfile not being supported) gets copied
+	// the normal way below.
+	fseek(input, offset, SEEK_SET);
+	fseek(output, 0, SEEK_CUR);
+#endif
+
+	byte buf[kBufSize];
+
+	while (length > 0) {
+		uint32 chunkSize = (length < kBufSize) ? length : kBufSize;
+		uint32 count = fread(buf, 1, chunkSize, input);
+		fwrite(buf, 1, count, output);
+
+		if (count != chunkSize)
+			break;
+
+		length -= chunkSize;
+	}
+}
+
 #define MKTAG(a0, a1, a2, a3) ((uint32)((a3) | ((a2) << 8) | ((a1) << 16) | ((a0) << 24)))
 
-int convertToSMF(FILE *input, FILE *output) {
-	if (readUint32LE(input) != MKTAG('S', 'E', 'Q', 'p')) {
-		fprintf(stderr, "Not a valid PSX SEQ\n");
-		return 1;
+// Build the file name for sequence n of a SEP: "foo.mid" becomes "foo_n.mid"
+char *getSequenceFilename(const char *outputName, uint16 n) {
+	const char *ext = strrchr(outputName, '.');
+	if (!ext || strchr(ext, '/') || strchr(ext, '\\'))
+		ext = outputName + strlen(outputName);
+
+	char *filename = new char[strlen(outputName) + 8];
+	memset(filename, 0, strlen(outputName) + 8);
+	memcpy(filename, outputName, ext - outputName);
+	sprintf(filename + (ext - outputName), "_%d%s", n, ext);
+	return filename;
+}
+
+// SEQ tempo events are FF 51 followed straight by the tempo, without the
+// length byte that SMF meta events have. Walk the events of a sequence and
+// note the offset of each tempo, so the length can be put in front of it
+// while copying. Only enough of each event is read to find where the next
+// one starts, and the input is left where it was.
+void findTempoEvents(FILE *input, uint32 length, std::vector<uint32> &tempoOffsets) {
+	uint32 start = ftell(input);
+	uint32 offset = 0;
+	byte runningStatus = 0;
+
+	while (offset < length) {
+		// Skip the delta time
+		byte b;
+		do {
+			b = readByte(input);
+			offset++;
+		} while ((b & 0x80) && offset < length);
+
+		if (offset >= length)
+			break;
+
+		byte status = readByte(input);
+		uint32 skip;
+
+		if (status & 0x80) {
+			offset++;
+		} else if (runningStatus) {
+			// That was the first data byte, so skip it with the rest
+			fseek(input, -1, SEEK_CUR);
+			status = runningStatus;
+		} else {
+			break;
+		}
+
+		if (status == 0xFF) {
+			byte type = readByte(input);
+			offset++;
+
+			// The only other meta event in SEQ's is the end of track
+			if (type != 0x51 || offset + 3 > length)
+				break;
+
+			tempoOffsets.push_back(offset);
+			skip = 3;
+		} else if (status == 0xF0 || status == 0xF7) {
+			skip = 0;
+
+			do {
+				b = readByte(input);
+				offset++;
+				skip = (skip << 7) | (b & 0x7f);
+			} while ((b & 0x80) && offset < length);
+		} else {
+			skip = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+			runningStatus = status;
+		}
+
+		fseek(input, skip, SEEK_CUR);
+		offset += skip;
 	}
 
-	if (readUint32BE(input) != 1) {
-		fprintf(stderr, "SEP files not handled yet!\n");
-		return 2;
+	fseek(input, start, SEEK_SET);
+}
+
+// Write the SMF for one sequence: a tempo change event from the header,
+// then the SEQ events with a length byte added to each tempo change
+void writeSMF(FILE *input, FILE *output, uint16 ppqn, uint32 tempo, uint32 seqDataSize) {
+	std::vector<uint32> tempoOffsets;
+	findTempoEvents(input, seqDataSize, tempoOffsets);
+
+	byte header[kSMFHeaderSize];
+	WRITE_BE_UINT32(header, MKTAG('M', 'T', 'h', 'd'));
+	WRITE_BE_UINT32(header + 4, 6);
+	WRITE_BE_UINT32(header + 8, 1);
+	WRITE_BE_UINT16(header + 12, ppqn);
+	WRITE_BE_UINT32(header + 14, MKTAG('M', 'T', 'r', 'k'));
+	WRITE_BE_UINT32(header + 18, seqDataSize + 7 + tempoOffsets.size());
+
+	// Fake a tempo change event
+	header[22] = 0x00;
+	header[23] = 0xFF;
+	header[24] = 0x51;
+	header[25] = 0x03;
+	WRITE_BE_UINT24(header + 26, tempo);
+
+	fwrite(header, 1, sizeof(header), output);
+
+	// Now, finally, add all the SEQ data. Everything between the tempo
+	// changes is copied as-is.
+	static const byte tempoLength = 0x03;
+	uint32 copied = 0;
+
+	for (uint32 i = 0; i < tempoOffsets.size(); i++) {
+		copyData(input, output, tempoOffsets[i] - copied);
+		fwrite(&tempoLength, 1, 1, output);
+		copied = tempoOffsets[i];
 	}
 
+	copyData(input, output, seqDataSize - copied);
+}
+
+int convertSEQToSMF(FILE *input, const char *outputName) {
 	uint16 ppqn = readUint16BE(input);
 	uint32 tempo = readUint24BE(input);
 	/* uint16 beat = */ readUint16BE(input); // Not sure what to do with this yet!
 
 	uint32 seqDataSize = getFileSize(input) - 15;
-	byte *seqData = new byte[seqDataSize];
-	fread(seqData, 1, seqDataSize, input);
 
-	// We parsed the data and now it's time to generate the SMF header
-	writeUint32BE(output, MKTAG('M', 'T', 'h', 'd'));
-	writeUint32BE(output, 6);
-	writeUint32BE(output, 1);
-	writeUint16BE(output, ppqn);
-	writeUint32BE(output, MKTAG('M', 'T', 'r', 'k'));
-	writeUint32BE(output, seqDataSize + 7);
+	bool toStdout = !strcmp(outputName, "-");
 
-	// Fake a tempo change event
-	writeByte(output, 0x00);
-	writeByte(output, 0xFF);
-	writeByte(output, 0x51);
-	writeByte(output, 0x03);
-	writeUint24BE(output, tempo);
+	FILE *output = toStdout ? stdout : fopen(outputName, "wb");
+	if (!output) {
+		fprintf(stderr, "Could not open '%s' for writing\n", outputName);
+		return 1;
+	}
+
+	writeSMF(input, output, ppqn, tempo, seqDataSize);
+
+	fflush(output);
+	if (!toStdout)
+		fclose(output);
+
+	return 0;
+}
+
+// A SEP is a bunch of SEQ's glued together, each with its own header.
+// They're all written out in one pass over the file.
+int convertSEPToSMF(FILE *input, const char *outputName) {
+	if (!strcmp(outputName, "-")) {
+		fprintf(stderr, "SEP files can't be written to stdout\n");
+		return 1;
+	}
 
-	// Now, finally, add all the SEQ data
-	fwrite(seqData, 1, seqDataSize, output);
+	uint32 fileSize = getFileSize(input);
+	uint32 sequenceCount = 0;
+
+	// Each sequence has a 13 byte header: id, ppqn, tempo, beat and length
+	while ((uint32)ftell(input) + 13 <= fileSize) {
+		uint16 id = readUint16BE(input);
+		uint16 ppqn = readUint16BE(input);
+		uint32 tempo = readUint24BE(input);
+		/* uint16 beat = */ readUint16BE(input);
+		uint32 seqDataSize = readUint32BE(input);
+
+		// SEPs are often padded with zeroes to a whole sector. Any header
+		// read from the padding has no data, so stop at the first empty
+		// sequence.
+		if (seqDataSize == 0)
+			break;
+
+		if (seqDataSize > fileSize - ftell(input)) {
+			fprintf(stderr, "Sequence %d is truncated\n", id);
+			return 1;
+		}
+
+		char *filename = getSequenceFilename(outputName, id);
+
+		FILE *output = fopen(filename, "wb");
+		if (!output) {
+			fprintf(stderr, "Could not open '%s' for writing\n", filename);
+			delete[] filename;
+			return 1;
+		}
+
+		printf("Writing sequence %d to %s\n", id, filename);
+		delete[] filename;
+
+		writeSMF(input, output, ppqn, tempo, seqDataSize);
+
+		fflush(output);
+		fclose(output);
+		sequenceCount++;
+	}
+
+	if (sequenceCount == 0) {
+		fprintf(stderr, "No sequences found in SEP\n");
+		return 1;
+	}
 
-	delete[] seqData;
 	return 0;
 }
 
+int convertToSMF(FILE *input, const char *outputName) {
+	if (readUint32LE(input) != MKTAG('S', 'E', 'Q', 'p')) {
+		fprintf(stderr, "Not a valid PSX SEQ\n");
+		return 1;
+	}
+
+	// SEQ's have a 32-bit version of 1. SEP's have a 16-bit version of 0,
+	// directly followed by the 16-bit id of the first sequence.
+	uint32 version = readUint32BE(input);
+
+	if (version == 1)
+		return convertSEQToSMF(input, outputName);
+
+	if ((version >> 16) == 0) {
+		fseek(input, -2, SEEK_CUR);
+		return convertSEPToSMF(input, outputName);
+	}
+
+	fprintf(stderr, "Unknown SEQ version %08x\n", version);
+	return 2;
+}
+
 int main(int argc, const char **argv) {
 	if (argc < 3) {
 		printf("Usage: %s <seq file input> <mid file output>\n", argv[0]);
+		printf("Use - as the output to write to stdout\n");
+		printf("SEP files get one output per sequence, named <output>_<id>.mid\n");
 		return 0;
 	}
 
@@ -138,13 +380,7 @@ int main(int argc, const char **argv) {
 		return 1;
 	}
 
-	FILE *output = fopen(argv[2], "wb");
-	if (!output) {
-		fprintf(stderr, "Could not open '%s' for writing\n", argv[2]);
-		return 1;
-	}
-
-	int result = convertToSMF(input, output);
+	int result = convertToSMF(input, argv[2]);
 
 	if (result != 0) {
 		fprintf(stderr, "Failed to extract!\n");
@@ -152,10 +388,8 @@ int main(int argc, const char **argv) {
 	}
 
 	fclose(input);
-	fflush(output);
-	fclose(output);
 
-	printf("All complete!\n");
+	fprintf(strcmp(argv[2], "-") ? stdout : stderr, "All complete!\n");
 
 	return 0;
 }
@@ -0,0 +1,455 @@
+/* seqindex.cpp -- Build seek indices for PlayStation SEQ MIDI files
+ * Copyright (c) 2012 Matthew Hoops (clone2727)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Standard types
+typedef unsigned char byte;
+typedef unsigned short uint16;
+typedef unsigned int uint32;
+
+// Helper functions for reading integers from the stream (maintaining endianness)
+byte readByte(FILE *input) {
+	byte b = 0;
+	fread(&b, 1, 1, input);
+	return b;
+}
+
+uint16 readUint16LE(FILE *input) {
+	uint16 x = readByte(input);
+	return x | (readByte(input) << 8);
+}
+
+uint32 readUint32LE(FILE *input) {
+	uint32 x = readUint16LE(input);
+	return x | (readUint16LE(input) << 16);
+}
+
+uint16 readUint16BE(FILE *input) {
+	uint16 x = readByte(input) << 8;
+	return x | readByte(input);
+}
+
+uint32 readUint24BE(FILE *input) {
+	uint32 x = readUint16BE(input) << 8;
+	return x | readByte(input);
+}
+
+uint32 readUint32BE(FILE *input) {
+	uint32 x = readUint16BE(input) << 16;
+	return x | readUint16BE(input);
+}
+
+uint32 getFileSize(FILE *input) {
+	uint32 startPos = ftell(input);
+	fseek(input, 0, SEEK_END);
+	uint32 size = ftell(input);
+	fseek(input, startPos, SEEK_SET);
+	return size;
+}
+
+#define MKTAG(a0, a1, a2, a3) ((uint32)((a3) | ((a2) << 8) | ((a1) << 16) | ((a0) << 24)))
+
+/** The controller state of one MIDI channel. */
+struct ChannelState {
+	byte program;
+	byte bank;
+	byte modulation;
+	byte volume;
+	byte pan;
+	byte expression;
+	byte sustain;
+	uint16 pitchBend;
+};
+
+/** Everything needed to resume playback from a point in the event stream. */
+struct SeqState {
+	uint32 tick;         ///< Time of the last event applied
+	uint32 offset;       ///< Offset of the delta time of the next event
+	uint32 tempo;        ///< Microseconds per quarter note
+	byte runningStatus;
+	ChannelState channels[16];
+};
+
+/** An in-memory SEQ (or SMF) event stream with a tick-indexed seek table. */
+class SeqIndex {
+public:
+	SeqIndex();
+	~SeqIndex();
+
+	/** Load a PSX SEQ or a type 0 SMF. */
+	bool load(FILE *input);
+
+	/**
+	 * Walk the whole stream once, taking a snapshot of the state every
+	 * interval ticks.
+	 */
+	bool buildIndex(uint32 interval);
+
+	/**
+	 * Get the state at tick: start from the closest snapshot at or before
+	 * tick and replay the few events in between. Returns the number of
+	 * events replayed, or -1 on error.
+	 */
+	int seek(uint32 tick, SeqState &state) const;
+
+	uint16 getPPQN() const { return _ppqn; }
+	uint32 getLength() const { return _length; }
+	uint32 getIndexSize() const { return _index.size(); }
+	const SeqState &getIndexEntry(uint32 i) const { return _index[i]; }
+
+private:
+	byte *_data;
+	uint32 _size;
+	bool _isSMF;        ///< Meta events carry a length (SEQ tempo events don't)
+	uint16 _ppqn;
+	uint32 _initialTempo;
+	uint32 _length;     ///< Tick of the last event
+
+	std::vector<SeqState> _index;
+
+	void reset(SeqState &state) const;
+
+	/** Read a variable length quantity, or return false if it runs off the end. */
+	bool readVLQ(uint32 &offset, uint32 &value) const;
+
+	/** Get the tick of the next event without applying it. */
+	bool peekEventTick(const SeqState &state, uint32 &tick) const;
+
+	/**
+	 * Apply the next event to the state. Returns false at the end of the
+	 * track or on bad data.
+	 */
+	bool applyEvent(SeqState &state) const;
+};
+
+SeqIndex::SeqIndex() {
+	_data = 0;
+	_size = 0;
+	_isSMF = false;
+	_ppqn = 0;
+	_initialTempo = 500000;
+	_length = 0;
+}
+
+SeqIndex::~SeqIndex() {
+	delete[] _data;
+}
+
+bool SeqIndex::load(FILE *input) {
+	uint32 tag = readUint32BE(input);
+
+	if (tag == MKTAG('p', 'Q', 'E', 'S')) {
+		if (readUint32BE(input) != 1) {
+			fprintf(stderr, "SEP files not handled, split them with seq2smf first\n");
+			return false;
+		}
+
+		_isSMF = false;
+		_ppqn = readUint16BE(input);
+		_initialTempo = readUint24BE(input);
+		/* uint16 beat = */ readUint16BE(input);
+		_size = getFileSize(input) - 15;
+	} else if (tag == MKTAG('M', 'T', 'h', 'd')) {
+		uint32 headerSize = readUint32BE(input);
+		uint16 format = readUint16BE(input);
+		/* uint16 trackCount = */ readUint16BE(input);
+		_ppqn = readUint16BE(input);
+		fseek(input, headerSize - 6, SEEK_CUR);
+
+		if (format != 0) {
+			fprintf(stderr, "Only type 0 SMF's are handled\n");
+			return false;
+		}
+
+		if (readUint32BE(input) != MKTAG('M', 'T', 'r', 'k')) {
+			fprintf(stderr, "MTrk chunk not found\n");
+			return false;
+		}
+
+		_isSMF = true;
+		_size = readUint32BE(input);
+	} else {
+		fprintf(stderr, "Not a valid PSX SEQ or SMF\n");
+		return false;
+	}
+
+	_data = new byte[_size];
+	if (fread(_data, 1, _size, input) != _size) {
+		fprintf(stderr, "Event data is truncated\n");
+		return false;
+	}
+
+	return true;
+}
+
+void SeqIndex::reset(SeqState &state) const {
+	memset(&state, 0, sizeof(state));
+	state.tempo = _initialTempo;
+
+	for (int i = 0; i < 16; i++) {
+		state.channels[i].volume = 100;
+		state.channels[i].pan = 64;
+		state.channels[i].expression = 127;
+		state.channels[i].pitchBend = 0x2000;
+	}
+}
+
+bool SeqIndex::readVLQ(uint32 &offset, uint32 &value) const {
+	value = 0;
+
+	for (int i = 0; i < 4; i++) {
+		if (offset >= _size)
+			return false;
+
+		byte b = _data[offset++];
+		value = (value << 7) | (b & 0x7f);
+
+		if (!(b & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+bool SeqIndex::peekEventTick(const SeqState &state, uint32 &tick) const {
+	uint32 offset = state.offset, delta;
+
+	if (!readVLQ(offset, delta) || offset >= _size)
+		return false;
+
+	tick = state.tick + delta;
+	return true;
+}
+
+bool SeqIndex::applyEvent(SeqState &state) const {
+	uint32 offset = state.offset, delta;
+
+	if (!readVLQ(offset, delta) || offset >= _size)
+		return false;
+
+	byte status = _data[offset];
+
+	// Running status: the previous status byte applies to these data bytes
+	if (status & 0x80)
+		offset++;
+	else if (state.runningStatus)
+		status = state.runningStatus;
+	else
+		return false;
+
+	if (status == 0xFF) {
+		if (offset >= _size)
+			return false;
+
+		byte type = _data[offset++];
+		uint32 length = 3;
+
+		if (type == 0x2F)
+			return false;
+
+		if (_isSMF && !readVLQ(offset, length))
+			return false;
+		else if (!_isSMF && type != 0x51)
+			return false; // The only other meta event in SEQ's is the end of track
+
+		if (offset + length > _size)
+			return false;
+
+		if (type == 0x51 && length == 3)
+			state.tempo = (_data[offset] << 16) | (_data[offset + 1] << 8) | _data[offset + 2];
+
+		offset += length;
+	} else if (status == 0xF0 || status == 0xF7) {
+		uint32 length;
+		if (!readVLQ(offset, length) || offset + length > _size)
+			return false;
+
+		offset += length;
+	} else {
+		uint32 length = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+		if (offset + length > _size)
+			return false;
+
+		ChannelState &channel = state.channels[status & 0xF];
+		byte data1 = _data[offset];
+		byte data2 = (length == 2) ? _data[offset + 1] : 0;
+
+		switch (status & 0xF0) {
+		case 0xB0:
+			switch (data1) {
+			case 0:
+				channel.bank = data2;
+				break;
+			case 1:
+				channel.modulation = data2;
+				break;
+			case 7:
+				channel.volume = data2;
+				break;
+			case 10:
+				channel.pan = data2;
+				break;
+			case 11:
+				channel.expression = data2;
+				break;
+			case 64:
+				channel.sustain = data2;
+				break;
+			}
+			break;
+		case 0xC0:
+			channel.program = data1;
+			break;
+		case 0xE0:
+			channel.pitchBend = data1 | (data2 << 7);
+			break;
+		}
+
+		state.runningStatus = status;
+		offset += length;
+	}
+
+	state.tick += delta;
+	state.offset = offset;
+	return true;
+}
+
+bool SeqIndex::buildIndex(uint32 interval) {
+	if (interval == 0)
+		return false;
+
+	_index.clear();
+
+	SeqState state;
+	reset(state);
+	_index.push_back(state);
+
+	uint32 nextSnapshot = interval;
+	uint32 tick;
+
+	while (peekEventTick(state, tick)) {
+		// Snapshot before the first event at or past each boundary
+		if (tick >= nextSnapshot) {
+			_index.push_back(state);
+			nextSnapshot = (tick / interval + 1) * interval;
+		}
+
+		if (!applyEvent(state))
+			break;
+	}
+
+	_length = state.tick;
+	return true;
+}
+
+int SeqIndex::seek(uint32 tick, SeqState &state) const {
+	if (_index.empty())
+		return -1;
+
+	// Binary search for the last snapshot at or before tick
+	uint32 low = 0, high = _index.size();
+	while (high - low > 1) {
+		uint32 mid = (low + high) / 2;
+
+		if (_index[mid].tick <= tick)
+			low = mid;
+		else
+			high = mid;
+	}
+
+	state = _index[low];
+
+	// ...and replay up to tick
+	int replayed = 0;
+	uint32 nextTick;
+
+	while (peekEventTick(state, nextTick) && nextTick <= tick) {
+		if (!applyEvent(state))
+			break;
+
+		replayed++;
+	}
+
+	return replayed;
+}
+
+int main(int argc, const char **argv) {
+	if (argc < 2) {
+		printf("Usage: %s <seq/mid file> [interval] [seek tick]\n", argv[0]);
+		printf("interval is the number of ticks between index entries (default: 4 beats)\n");
+		return 0;
+	}
+
+	FILE *input = fopen(argv[1], "rb");
+	if (!input) {
+		fprintf(stderr, "Could not open '%s' for reading\n", argv[1]);
+		return 1;
+	}
+
+	SeqIndex index;
+	bool loaded = index.load(input);
+	fclose(input);
+
+	if (!loaded)
+		return 1;
+
+	uint32 interval = (argc > 2) ? atoi(argv[2]) : index.getPPQN() * 4;
+
+	if (!index.buildIndex(interval)) {
+		fprintf(stderr, "Invalid index interval %d\n", interval);
+		return 1;
+	}
+
+	printf("PPQN = %d\n", index.getPPQN());
+	printf("Length = %d ticks\n", index.getLength());
+	printf("Index entries = %d (%d bytes)\n\n", index.getIndexSize(), index.getIndexSize() * (uint32)sizeof(SeqState));
+
+	printf("    Tick   Offset    Tempo\n");
+	for (uint32 i = 0; i < index.getIndexSize(); i++) {
+		const SeqState &entry = index.getIndexEntry(i);
+		printf("%8d %8x %8d\n", entry.tick, entry.offset, entry.tempo);
+	}
+
+	if (argc > 3) {
+		uint32 tick = atoi(argv[3]);
+		SeqState state;
+		int replayed = index.seek(tick, state);
+
+		if (replayed < 0) {
+			fprintf(stderr, "Failed to seek to tick %d\n", tick);
+			return 1;
+		}
+
+		printf("\nSeek to tick %d: replayed %d event(s), resume at offset %x\n", tick, replayed, state.offset);
+		printf("Tempo = %d\n", state.tempo);
+		printf("Ch  Prog Bank  Vol  Pan  Exp  Mod  Sus  Bend\n");
+
+		for (int i = 0; i < 16; i++) {
+			const ChannelState &channel = state.channels[i];
+			printf("%2d  %4d %4d %4d %4d %4d %4d %4d %5d\n", i, channel.program, channel.bank, channel.volume,
+					channel.pan, channel.expression, channel.modulation, channel.sustain, channel.pitchBend);
+		}
+	}
+
+	return 0;
+}
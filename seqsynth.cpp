@@ -0,0 +1,959 @@
+/* seqsynth.cpp -- Render PlayStation SEQ files with VAB instruments to WAVE
+ * Copyright (c) 2012 Matthew Hoops (clone2727)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Songs are rendered on a pool of threads where pthreads are available,
+// and one after another everywhere else
+#ifndef _WIN32
+#define USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "vab.h"
+
+// Standard types
+typedef unsigned char byte;
+typedef unsigned short uint16;
+typedef unsigned int uint32;
+typedef signed short int16;
+typedef signed int int32;
+typedef unsigned long long uint64;
+
+// Constants
+enum {
+	kOutputRate = 44100, // VAGs have no rate of their own; this is the SPU's
+	kVoiceCount = 24,
+	kMixFrames = 1024,
+	kMaxTailFrames = kOutputRate * 10
+};
+
+// Helper functions for reading integers from the stream (maintaining endianness)
+byte readByte(FILE *file) {
+	byte b = 0;
+	fread(&b, 1, 1, file);
+	return b;
+}
+
+uint16 readUint16LE(FILE *file) {
+	uint16 x = readByte(file);
+	return x | readByte(file) << 8;
+}
+
+uint32 readUint32LE(FILE *file) {
+	uint16 x = readUint16LE(file);
+	return x | readUint16LE(file) << 16;
+}
+
+uint16 readUint16BE(FILE *file) {
+	uint16 x = readByte(file) << 8;
+	return x | readByte(file);
+}
+
+uint32 readUint24BE(FILE *file) {
+	uint32 x = readUint16BE(file) << 8;
+	return x | readByte(file);
+}
+
+uint32 readUint32BE(FILE *file) {
+	uint32 x = readUint16BE(file) << 16;
+	return x | readUint16BE(file);
+}
+
+void writeByte(FILE *file, byte b) {
+	fwrite(&b, 1, 1, file);
+}
+
+void writeUint16LE(FILE *file, uint16 x) {
+	writeByte(file, x & 0xff);
+	writeByte(file, x >> 8);
+}
+
+void writeUint32LE(FILE *file, uint32 x) {
+	writeUint16LE(file, x & 0xffff);
+	writeUint16LE(file, x >> 16);
+}
+
+void writeUint16BE(FILE *file, uint16 x) {
+	writeByte(file, x >> 8);
+	writeByte(file, x & 0xff);
+}
+
+void writeUint32BE(FILE *file, uint32 x) {
+	writeUint16BE(file, x >> 16);
+	writeUint16BE(file, x & 0xffff);
+}
+
+uint32 getFileSize(FILE *file) {
+	uint32 pos = ftell(file);
+	fseek(file, 0, SEEK_END);
+	uint32 size = ftell(file);
+	fseek(file, pos, SEEK_SET);
+	return size;
+}
+
+/** A decoded VAG, ready to be played by a voice. */
+struct Sample {
+	Sample() { data = 0; length = 0; loopStart = -1; }
+	~Sample() { delete[] data; }
+
+	int16 *data;
+	uint32 length;
+	int loopStart; ///< -1 if the sample doesn't loop
+};
+
+/** A VAB with every VAG decoded up front, shared by all songs rendered. */
+struct SoundBank {
+	SoundBank() { header.tones = 0; samples = 0; }
+	~SoundBank() { delete[] header.tones; delete[] samples; }
+
+	VABHeader header;
+	int toneBlocks[kMaxPrograms]; ///< Tone block of each program, or -1
+	Sample *samples;              ///< Indexed by VAG number (1-based)
+};
+
+bool loadSoundBank(FILE *vh, FILE *vb, SoundBank &bank) {
+	if (!readVH(vh, bank.header))
+		return false;
+
+	// The tone blocks belong to the programs that have tones, in order
+	int toneBlock = 0;
+	for (uint32 i = 0; i < kMaxPrograms; i++) {
+		if (bank.header.programs[i].toneCount != 0 && toneBlock < bank.header.programCount)
+			bank.toneBlocks[i] = toneBlock++;
+		else
+			bank.toneBlocks[i] = -1;
+	}
+
+	bank.samples = new Sample[bank.header.vagCount + 1];
+
+	for (uint32 i = 1; i <= bank.header.vagCount; i++) {
+		uint32 size = bank.header.vagSizes[i];
+		byte *adpcm = new byte[size];
+
+		if (fread(adpcm, 1, size, vb) != size) {
+			printf("VB data is truncated\n");
+			delete[] adpcm;
+			return false;
+		}
+
+		Sample &sample = bank.samples[i];
+		sample.data = new int16[size / kADPCMBlockSize * kSamplesPerBlock + 1];
+		sample.length = decodeSPUADPCM(adpcm, size, sample.data, sample.loopStart);
+		delete[] adpcm;
+	}
+
+	return true;
+}
+
+/** The SPU ADSR envelope generator. */
+struct Envelope {
+	enum Phase {
+		kPhaseOff,
+		kPhaseAttack,
+		kPhaseDecay,
+		kPhaseSustain,
+		kPhaseRelease
+	};
+
+	Phase phase;
+	int level;        ///< 0 to 0x7FFF
+	int sustainLevel;
+	uint16 adsr1, adsr2;
+
+	// Current rate
+	int step;
+	uint32 cycles;
+	uint32 counter;
+	bool decreasing;
+	bool exponential;
+
+	void keyOn(uint16 a1, uint16 a2);
+	void keyOff();
+	void setPhase(Phase newPhase);
+	void setRate(int rate, bool decrease, bool exp);
+	void tick();
+};
+
+void Envelope::keyOn(uint16 a1, uint16 a2) {
+	adsr1 = a1;
+	adsr2 = a2;
+	level = 0;
+	sustainLevel = ((adsr1 & 0xF) + 1) * 0x800;
+	if (sustainLevel > 0x7FFF)
+		sustainLevel = 0x7FFF;
+
+	setPhase(kPhaseAttack);
+}
+
+void Envelope::keyOff() {
+	if (phase != kPhaseOff)
+		setPhase(kPhaseRelease);
+}
+
+void Envelope::setPhase(Phase newPhase) {
+	phase = newPhase;
+
+	switch (phase) {
+	case kPhaseAttack:
+		setRate((adsr1 >> 8) & 0x7F, false, (adsr1 & 0x8000) != 0);
+		break;
+	case kPhaseDecay:
+		setRate(((adsr1 >> 4) & 0xF) << 2, true, true);
+		break;
+	case kPhaseSustain:
+		setRate((adsr2 >> 6) & 0x7F, (adsr2 & 0x4000) != 0, (adsr2 & 0x8000) != 0);
+		break;
+	case kPhaseRelease:
+		setRate((adsr2 & 0x1F) << 2, true, (adsr2 & 0x20) != 0);
+		break;
+	default:
+		break;
+	}
+}
+
+// Rates are 7-bit: a shift in the top 5 bits and a step in the low 2. Slow
+// rates wait several samples between steps, fast ones take bigger steps.
+void Envelope::setRate(int rate, bool decrease, bool exp) {
+	int shift = rate >> 2;
+	int baseStep = decrease ? (-8 + (rate & 3)) : (7 - (rate & 3));
+
+	step = (shift < 11) ? baseStep << (11 - shift) : baseStep;
+	cycles = (shift > 11) ? 1 << (shift - 11) : 1;
+	counter = 0;
+	decreasing = decrease;
+	exponential = exp;
+}
+
+void Envelope::tick() {
+	if (phase == kPhaseOff)
+		return;
+
+	uint32 wait = cycles;
+	int delta = step;
+
+	// Exponential increase slows down above 0x6000, exponential decrease
+	// scales with the current level
+	if (exponential && !decreasing && level > 0x6000)
+		wait *= 4;
+	else if (exponential && decreasing)
+		delta = (delta * level) >> 15;
+
+	if (++counter < wait)
+		return;
+
+	counter = 0;
+	level += delta;
+
+	if (level > 0x7FFF)
+		level = 0x7FFF;
+	else if (level < 0)
+		level = 0;
+
+	switch (phase) {
+	case kPhaseAttack:
+		if (level == 0x7FFF)
+			setPhase(kPhaseDecay);
+		break;
+	case kPhaseDecay:
+		if (level <= sustainLevel)
+			setPhase(kPhaseSustain);
+		break;
+	case kPhaseRelease:
+		if (level == 0)
+			phase = kPhaseOff;
+		break;
+	default:
+		break;
+	}
+}
+
+struct Voice {
+	const Sample *sample;
+	const ToneAttributes *tone;
+	Envelope envelope;
+	byte channel;
+	byte note;
+	uint32 age;     ///< When the voice was started, for voice stealing
+	uint32 position; ///< Whole samples into the VAG
+	uint32 fraction; ///< ...plus 1/65536ths of a sample
+	uint32 pitch;    ///< 16.16 fixed point step per output sample
+	int volumeLeft;  ///< 0 to 0x7FFF
+	int volumeRight;
+};
+
+struct Channel {
+	byte program;
+	byte volume;
+	byte pan;
+	byte expression;
+	uint16 pitchBend;
+};
+
+/** Plays a SEQ through a sound bank and writes the mix to a WAVE. */
+class SeqRenderer {
+public:
+	SeqRenderer(const SoundBank &bank);
+
+	bool render(const byte *seqData, uint32 seqSize, uint16 ppqn, uint32 tempo, FILE *output);
+
+	uint32 getFramesRendered() const { return _framesRendered; }
+	uint64 getVoiceFrames() const { return _voiceFrames; }
+
+private:
+	const SoundBank &_bank;
+	Voice _voices[kVoiceCount];
+	Channel _channels[16];
+	uint32 _voiceAge;
+	uint32 _framesRendered;
+	uint64 _voiceFrames; ///< Total frames mixed across all voices
+
+	int32 _mixBuffer[kMixFrames * 2];
+	int16 _voiceBuffer[kMixFrames];
+	byte _outputBuffer[kMixFrames * 4];
+
+	void noteOn(byte channel, byte note, byte velocity);
+	void noteOff(byte channel, byte note);
+	void updatePitch(Voice &voice);
+	void updateVolume(Voice &voice, byte velocity);
+	Voice &allocateVoice();
+
+	bool anyVoiceActive() const;
+	void renderFrames(uint32 frameCount, FILE *output);
+	uint32 renderVoice(Voice &voice, int16 *buffer, uint32 frameCount);
+};
+
+SeqRenderer::SeqRenderer(const SoundBank &bank) : _bank(bank) {
+	for (int i = 0; i < kVoiceCount; i++)
+		_voices[i].envelope.phase = Envelope::kPhaseOff;
+
+	for (int i = 0; i < 16; i++) {
+		_channels[i].program = 0;
+		_channels[i].volume = 127;
+		_channels[i].pan = 64;
+		_channels[i].expression = 127;
+		_channels[i].pitchBend = 0x2000;
+	}
+
+	_voiceAge = 0;
+	_framesRendered = 0;
+	_voiceFrames = 0;
+}
+
+Voice &SeqRenderer::allocateVoice() {
+	// Take a free voice, otherwise steal a releasing one, otherwise the oldest
+	Voice *best = &_voices[0];
+
+	for (int i = 0; i < kVoiceCount; i++) {
+		Voice &voice = _voices[i];
+
+		if (voice.envelope.phase == Envelope::kPhaseOff)
+			return voice;
+
+		bool releasing = voice.envelope.phase == Envelope::kPhaseRelease;
+		bool bestReleasing = best->envelope.phase == Envelope::kPhaseRelease;
+
+		if ((releasing && !bestReleasing) || (releasing == bestReleasing && voice.age < best->age))
+			best = &voice;
+	}
+
+	return *best;
+}
+
+void SeqRenderer::updatePitch(Voice &voice) {
+	const Channel &channel = _channels[voice.channel];
+
+	// Semitones away from the center note; shift is in 1/128ths
+	double semitones = voice.note - voice.tone->center - voice.tone->shift / 128.0;
+
+	if (channel.pitchBend >= 0x2000)
+		semitones += (channel.pitchBend - 0x2000) / 8192.0 * voice.tone->pitchBendMax;
+	else
+		semitones -= (0x2000 - channel.pitchBend) / 8192.0 * voice.tone->pitchBendMin;
+
+	// The SPU can't play faster than 4x
+	double ratio = pow(2.0, semitones / 12.0);
+	if (ratio > 4.0)
+		ratio = 4.0;
+
+	voice.pitch = (uint32)(ratio * 65536.0);
+}
+
+void SeqRenderer::updateVolume(Voice &voice, byte velocity) {
+	const Channel &channel = _channels[voice.channel];
+	const ProgramAttributes &program = _bank.header.programs[channel.program];
+
+	double volume = (velocity / 127.0) * (voice.tone->volume / 127.0) * (program.volume / 127.0) *
+			(_bank.header.volume / 127.0) * (channel.volume / 127.0) * (channel.expression / 127.0);
+
+	// Pans are all centered on 64, so just add up the offsets
+	int pan = 64 + (voice.tone->pan - 64) + (program.pan - 64) + (channel.pan - 64);
+	if (pan < 0)
+		pan = 0;
+	else if (pan > 127)
+		pan = 127;
+
+	double left = (pan < 64) ? 1.0 : (127 - pan) / 63.0;
+	double right = (pan > 64) ? 1.0 : pan / 64.0;
+
+	voice.volumeLeft = (int)(volume * left * 0x7FFF);
+	voice.volumeRight = (int)(volume * right * 0x7FFF);
+}
+
+void SeqRenderer::noteOn(byte channel, byte note, byte velocity) {
+	int toneBlock = _bank.toneBlocks[_channels[channel].program];
+	if (toneBlock < 0)
+		return;
+
+	const ProgramAttributes &program = _bank.header.programs[_channels[channel].program];
+
+	// Every tone covering the note plays, which is how layered sounds work
+	for (uint32 i = 0; i < program.toneCount && i < kTonesPerProgram; i++) {
+		const ToneAttributes &tone = _bank.header.tones[toneBlock * kTonesPerProgram + i];
+
+		if (note < tone.minNote || note > tone.maxNote || tone.vag == 0 || tone.vag > _bank.header.vagCount)
+			continue;
+
+		Voice &voice = allocateVoice();
+		voice.sample = &_bank.samples[tone.vag];
+		voice.tone = &tone;
+		voice.channel = channel;
+		voice.note = note;
+		voice.age = _voiceAge++;
+		voice.position = 0;
+		voice.fraction = 0;
+		voice.envelope.keyOn(tone.adsr1, tone.adsr2);
+		updatePitch(voice);
+		updateVolume(voice, velocity);
+	}
+}
+
+void SeqRenderer::noteOff(byte channel, byte note) {
+	for (int i = 0; i < kVoiceCount; i++)
+		if (_voices[i].channel == channel && _voices[i].note == note && _voices[i].envelope.phase != Envelope::kPhaseRelease)
+			_voices[i].envelope.keyOff();
+}
+
+bool SeqRenderer::anyVoiceActive() const {
+	for (int i = 0; i < kVoiceCount; i++)
+		if (_voices[i].envelope.phase != Envelope::kPhaseOff)
+			return true;
+
+	return false;
+}
+
+// Run one voice for up to frameCount frames: linear interpolation and the
+// envelope. Returns the number of frames written to buffer, which is less
+// than frameCount if the voice ended.
+uint32 SeqRenderer::renderVoice(Voice &voice, int16 *buffer, uint32 frameCount) {
+	const int16 *data = voice.sample->data;
+	const uint32 length = voice.sample->length;
+	const int loopStart = voice.sample->loopStart;
+	uint32 i = 0;
+
+	while (i < frameCount) {
+		if (voice.position >= length) {
+			if (loopStart < 0 || (uint32)loopStart >= length) {
+				voice.envelope.phase = Envelope::kPhaseOff;
+				break;
+			}
+
+			voice.position = loopStart + (voice.position - length) % (length - loopStart);
+		}
+
+		uint32 index = voice.position;
+		int s0 = data[index];
+		int s1 = (index + 1 < length) ? data[index + 1] : ((loopStart >= 0) ? data[loopStart] : 0);
+		int frac = voice.fraction >> 1;
+		int sample = s0 + (((s1 - s0) * frac) >> 15);
+
+		buffer[i++] = (sample * voice.envelope.level) >> 15;
+
+		voice.fraction += voice.pitch;
+		voice.position += voice.fraction >> 16;
+		voice.fraction &= 0xFFFF;
+		voice.envelope.tick();
+
+		if (voice.envelope.phase == Envelope::kPhaseOff)
+			break;
+	}
+
+	return i;
+}
+
+// Add count mono samples to the interleaved stereo buffer at the given
+// volumes (0 to 0x7FFF)
+void mixMonoToStereo(const int16 *src, int32 *dst, uint32 count, int volumeLeft, int volumeRight) {
+	uint32 i = 0;
+
+#ifdef __SSE2__
+	// Both factors fit in 16 bits, so the full 32-bit products are put
+	// together from the low and high halves of 16-bit multiplies
+	const __m128i volume = _mm_setr_epi16(volumeLeft, volumeRight, volumeLeft, volumeRight,
+			volumeLeft, volumeRight, volumeLeft, volumeRight);
+
+	for (; i + 8 <= count; i += 8) {
+		__m128i samples = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i halves[2] = { _mm_unpacklo_epi16(samples, samples), _mm_unpackhi_epi16(samples, samples) };
+
+		for (int j = 0; j < 2; j++) {
+			__m128i low = _mm_mullo_epi16(halves[j], volume);
+			__m128i high = _mm_mulhi_epi16(halves[j], volume);
+			int32 *out = dst + (i + j * 4) * 2;
+
+			__m128i first = _mm_srai_epi32(_mm_unpacklo_epi16(low, high), 15);
+			__m128i second = _mm_srai_epi32(_mm_unpackhi_epi16(low, high), 15);
+			_mm_storeu_si128((__m128i *)out, _mm_add_epi32(_mm_loadu_si128((const __m128i *)out), first));
+			_mm_storeu_si128((__m128i *)(out + 4), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(out + 4)), second));
+		}
+	}
+#endif
+
+	for (; i < count; i++) {
+		dst[i * 2] += (src[i] * volumeLeft) >> 15;
+		dst[i * 2 + 1] += (src[i] * volumeRight) >> 15;
+	}
+}
+
+// Clamp the mix to 16-bit little endian samples
+void convertMixToPCM(const int32 *src, byte *dst, uint32 count) {
+	uint32 i = 0;
+
+#ifdef __SSE2__
+	// SSE2 only exists on little endian machines, so the saturated samples
+	// can be stored as they are
+	for (; i + 8 <= count; i += 8) {
+		__m128i first = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i second = _mm_loadu_si128((const __m128i *)(src + i + 4));
+		_mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packs_epi32(first, second));
+	}
+#endif
+
+	for (; i < count; i++) {
+		int32 sample = src[i];
+
+		if (sample > 32767)
+			sample = 32767;
+		else if (sample < -32768)
+			sample = -32768;
+
+		dst[i * 2] = sample & 0xff;
+		dst[i * 2 + 1] = (sample >> 8) & 0xff;
+	}
+}
+
+void SeqRenderer::renderFrames(uint32 frameCount, FILE *output) {
+	while (frameCount > 0) {
+		uint32 chunk = (frameCount < kMixFrames) ? frameCount : kMixFrames;
+		memset(_mixBuffer, 0, chunk * 2 * sizeof(int32));
+
+		for (int i = 0; i < kVoiceCount; i++) {
+			Voice &voice = _voices[i];
+
+			if (voice.envelope.phase != Envelope::kPhaseOff) {
+				uint32 count = renderVoice(voice, _voiceBuffer, chunk);
+				mixMonoToStereo(_voiceBuffer, _mixBuffer, count, voice.volumeLeft, voice.volumeRight);
+				_voiceFrames += count;
+			}
+		}
+
+		convertMixToPCM(_mixBuffer, _outputBuffer, chunk * 2);
+		fwrite(_outputBuffer, 1, chunk * 4, output);
+		_framesRendered += chunk;
+		frameCount -= chunk;
+	}
+}
+
+// Parse a variable length quantity, returning false if it runs off the end
+bool readVLQ(const byte *data, uint32 size, uint32 &offset, uint32 &value) {
+	value = 0;
+
+	for (int i = 0; i < 4; i++) {
+		if (offset >= size)
+			return false;
+
+		byte b = data[offset++];
+		value = (value << 7) | (b & 0x7f);
+
+		if (!(b & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+bool SeqRenderer::render(const byte *seqData, uint32 seqSize, uint16 ppqn, uint32 tempo, FILE *output) {
+	double framePosition = 0.0;
+	uint32 offset = 0;
+	byte runningStatus = 0;
+
+	while (offset < seqSize) {
+		uint32 delta;
+		if (!readVLQ(seqData, seqSize, offset, delta) || offset >= seqSize)
+			break;
+
+		// Render up to the event. Keep the fractional part around so that
+		// rounding doesn't make the song drift.
+		framePosition += (double)delta * tempo / ppqn * kOutputRate / 1000000.0;
+		uint32 target = (uint32)framePosition;
+		if (target > _framesRendered)
+			renderFrames(target - _framesRendered, output);
+
+		byte status = seqData[offset];
+		if (status & 0x80)
+			offset++;
+		else if (runningStatus)
+			status = runningStatus;
+		else
+			break;
+
+		if (status == 0xFF) {
+			// SEQ meta events have no length: only tempo and end of track exist
+			if (offset >= seqSize || seqData[offset] != 0x51 || offset + 4 > seqSize)
+				break;
+
+			tempo = (seqData[offset + 1] << 16) | (seqData[offset + 2] << 8) | seqData[offset + 3];
+			offset += 4;
+			continue;
+		}
+
+		uint32 length = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+		if (offset + length > seqSize)
+			break;
+
+		byte channel = status & 0xF;
+		byte data1 = seqData[offset];
+		byte data2 = (length == 2) ? seqData[offset + 1] : 0;
+		runningStatus = status;
+		offset += length;
+
+		switch (status & 0xF0) {
+		case 0x80:
+			noteOff(channel, data1);
+			break;
+		case 0x90:
+			if (data2 == 0)
+				noteOff(channel, data1);
+			else
+				noteOn(channel, data1, data2);
+			break;
+		case 0xB0:
+			if (data1 == 7)
+				_channels[channel].volume = data2;
+			else if (data1 == 10)
+				_channels[channel].pan = data2;
+			else if (data1 == 11)
+				_channels[channel].expression = data2;
+			break;
+		case 0xC0:
+			_channels[channel].program = data1 & 0x7F;
+			break;
+		case 0xE0:
+			_channels[channel].pitchBend = data1 | (data2 << 7);
+
+			for (int i = 0; i < kVoiceCount; i++)
+				if (_voices[i].channel == channel && _voices[i].envelope.phase != Envelope::kPhaseOff)
+					updatePitch(_voices[i]);
+			break;
+		}
+	}
+
+	// Let everything still playing release, up to a limit
+	for (int i = 0; i < kVoiceCount; i++)
+		_voices[i].envelope.keyOff();
+
+	uint32 tailFrames = 0;
+	while (anyVoiceActive() && tailFrames < kMaxTailFrames) {
+		renderFrames(kMixFrames, output);
+		tailFrames += kMixFrames;
+	}
+
+	return true;
+}
+
+void writeWaveHeader(FILE *output, uint32 dataSize) {
+	writeUint32BE(output, 'RIFF');
+	writeUint32LE(output, dataSize + 36);
+	writeUint32BE(output, 'WAVE');
+	writeUint32BE(output, 'fmt ');
+	writeUint32LE(output, 16);
+	writeUint16LE(output, 1);
+	writeUint16LE(output, 2);
+	writeUint32LE(output, kOutputRate);
+	writeUint32LE(output, kOutputRate * 4);
+	writeUint16LE(output, 4);
+	writeUint16LE(output, 16);
+	writeUint32BE(output, 'data');
+	writeUint32LE(output, dataSize);
+}
+
+// Seconds of CPU time used by this thread, so that songs rendered side by
+// side each get timed on their own
+double getThreadCPUTime() {
+#ifdef USE_THREADS
+	timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/** One song to render. The results are filled in by whichever thread picks it up. */
+struct SongJob {
+	const char *seqName;
+	const char *outputName;
+	bool rendered;
+	uint32 frames;
+	uint64 voiceFrames;
+	double seconds;
+};
+
+bool renderSong(const SoundBank &bank, SongJob &job) {
+	FILE *input = fopen(job.seqName, "rb");
+	if (!input) {
+		printf("Could not open '%s' for reading\n", job.seqName);
+		return false;
+	}
+
+	// The header is 15 bytes: tag, version, ppqn, tempo and beat
+	uint32 fileSize = getFileSize(input);
+
+	if (fileSize < 15 || readUint32LE(input) != 'SEQp' || readUint32BE(input) != 1) {
+		printf("'%s' is not a PSX SEQ\n", job.seqName);
+		fclose(input);
+		return false;
+	}
+
+	uint16 ppqn = readUint16BE(input);
+	uint32 tempo = readUint24BE(input);
+	/* uint16 beat = */ readUint16BE(input);
+
+	// Delta times are converted to frames by dividing by this
+	if (ppqn == 0) {
+		printf("'%s' has a PPQN of 0\n", job.seqName);
+		fclose(input);
+		return false;
+	}
+
+	uint32 seqSize = fileSize - 15;
+	byte *seqData = new byte[seqSize];
+
+	if (fread(seqData, 1, seqSize, input) != seqSize) {
+		printf("Failed to read '%s'\n", job.seqName);
+		delete[] seqData;
+		fclose(input);
+		return false;
+	}
+
+	fclose(input);
+
+	FILE *output = fopen(job.outputName, "wb");
+	if (!output) {
+		printf("Could not open '%s' for writing\n", job.outputName);
+		delete[] seqData;
+		return false;
+	}
+
+	// Sizes are filled in once we know how long the song is
+	writeWaveHeader(output, 0);
+
+	SeqRenderer *renderer = new SeqRenderer(bank);
+	double startTime = getThreadCPUTime();
+	renderer->render(seqData, seqSize, ppqn, tempo, output);
+	job.seconds = getThreadCPUTime() - startTime;
+
+	job.frames = renderer->getFramesRendered();
+	job.voiceFrames = renderer->getVoiceFrames();
+	fseek(output, 0, SEEK_SET);
+	writeWaveHeader(output, job.frames * 4);
+	fflush(output);
+	fclose(output);
+
+	delete renderer;
+	delete[] seqData;
+	return true;
+}
+
+struct RenderContext {
+	const SoundBank *bank;
+	SongJob *jobs;
+	uint32 jobCount;
+	uint32 nextJob;
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+bool takeJob(RenderContext &context, uint32 &index) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&context.lock);
+#endif
+
+	index = context.nextJob;
+	bool found = index < context.jobCount;
+	if (found)
+		context.nextJob++;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&context.lock);
+#endif
+
+	return found;
+}
+
+// Keep taking songs until there are none left. Each song has its own
+// renderer and output file; the bank is only ever read.
+void *renderWorker(void *arg) {
+	RenderContext &context = *(RenderContext *)arg;
+	uint32 index;
+
+	while (takeJob(context, index))
+		context.jobs[index].rendered = renderSong(*context.bank, context.jobs[index]);
+
+	return 0;
+}
+
+uint32 getThreadCount(uint32 jobCount) {
+	uint32 threadCount = 1;
+
+#ifdef USE_THREADS
+	long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpuCount > 1)
+		threadCount = cpuCount;
+#endif
+
+	return (threadCount < jobCount) ? threadCount : (jobCount ? jobCount : 1);
+}
+
+// Render every song, one song per thread. This thread renders songs too.
+void renderAllSongs(RenderContext &context) {
+#ifdef USE_THREADS
+	pthread_mutex_init(&context.lock, 0);
+
+	uint32 extraThreads = getThreadCount(context.jobCount) - 1;
+	pthread_t *threads = new pthread_t[extraThreads + 1];
+	uint32 started = 0;
+
+	for (; started < extraThreads; started++)
+		if (pthread_create(&threads[started], 0, renderWorker, &context) != 0)
+			break;
+
+	renderWorker(&context);
+
+	for (uint32 i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+
+	delete[] threads;
+	pthread_mutex_destroy(&context.lock);
+#else
+	renderWorker(&context);
+#endif
+}
+
+int main(int argc, const char **argv) {
+	printf("\nPSX SEQ Renderer\n");
+	printf("Renders PlayStation SEQ files with their VAB instruments to WAVE\n");
+	printf("Written by Matthew Hoops (clone2727)\n");
+	printf("See license.txt for the license\n\n");
+
+	if (argc < 5 || (argc - 3) % 2 != 0) {
+		printf("Usage: %s <vab or vh> <vb or -> <seq> <wav> [<seq> <wav> ...]\n", argv[0]);
+		printf("Use - for the VB if it's part of the VAB\n");
+		return 0;
+	}
+
+	FILE *vh = fopen(argv[1], "rb");
+	if (!vh) {
+		printf("Could not open '%s' for reading\n", argv[1]);
+		return 1;
+	}
+
+	FILE *vb = vh;
+	if (strcmp(argv[2], "-")) {
+		vb = fopen(argv[2], "rb");
+		if (!vb) {
+			printf("Could not open '%s' for reading\n", argv[2]);
+			fclose(vh);
+			return 1;
+		}
+	}
+
+	// The bank is decoded once and shared by every song
+	SoundBank bank;
+	bool loaded = loadSoundBank(vh, vb, bank);
+
+	if (vb != vh)
+		fclose(vb);
+	fclose(vh);
+
+	if (!loaded)
+		return 1;
+
+	RenderContext context;
+	context.bank = &bank;
+	context.jobCount = (argc - 3) / 2;
+	context.jobs = new SongJob[context.jobCount];
+	context.nextJob = 0;
+
+	for (uint32 i = 0; i < context.jobCount; i++) {
+		context.jobs[i].seqName = argv[3 + i * 2];
+		context.jobs[i].outputName = argv[4 + i * 2];
+		context.jobs[i].rendered = false;
+	}
+
+	printf("Rendering %d song(s) on %d thread(s)...\n", context.jobCount, getThreadCount(context.jobCount));
+	renderAllSongs(context);
+
+	// Report in the order given once everything is done
+	bool allDone = true;
+
+	for (uint32 i = 0; i < context.jobCount; i++) {
+		const SongJob &job = context.jobs[i];
+
+		if (!job.rendered) {
+			allDone = false;
+			continue;
+		}
+
+		double songLength = (double)job.frames / kOutputRate;
+		printf("%s -> %s: %.1fs of audio in %.2fs", job.seqName, job.outputName, songLength, job.seconds);
+		if (job.seconds > 0.0)
+			printf(" (%.0fx real time)", songLength / job.seconds);
+		if (job.voiceFrames > 0)
+			printf(", %.1fns per voice frame", job.seconds * 1e9 / job.voiceFrames);
+		printf("\n");
+	}
+
+	delete[] context.jobs;
+
+	if (!allDone)
+		return 1;
+
+	printf("\nAll Done!\n");
+	return 0;
+}
@@ -0,0 +1,125 @@
+/* sfxbank.h -- Read sound banks written by extract_cc3_sfx --bank
+ * Copyright (c) 2012 Matthew Hoops (clone2727)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+// A sound bank holds every sound of an SFX archive in one file. All values
+// are little-endian:
+//
+//   0x00  'SFXB'
+//   0x04  Version (1)
+//   0x08  Number of sounds
+//   0x0C  Reserved (0)
+//   0x10  One 16-byte record per sound:
+//           0x00  Offset of the PCM data from the start of the bank
+//           0x04  Length of the PCM data
+//           0x08  Sample rate
+//           0x0C  Channels (16-bit)
+//           0x0E  Bits per sample (16-bit)
+//
+// The PCM data of every sound starts on a 16-byte boundary. Entries that
+// were not selected when the bank was written have a length of 0.
+//
+// SFXBank works on a bank that is already in memory (loaded or mmap'd) and
+// never copies any sample data; the sounds it hands out point straight into
+// that memory.
+
+#ifndef SFXBANK_H
+#define SFXBANK_H
+
+struct SFXBankSound {
+	const unsigned char *data;
+	unsigned int length;
+	unsigned int rate;
+	unsigned short channels;
+	unsigned short bitsPerSample;
+};
+
+class SFXBank {
+public:
+	SFXBank() : _data(0), _soundCount(0) {}
+
+	// Attach to a bank of size bytes. The memory must stay valid for as
+	// long as the bank and its sounds are in use. All records are checked
+	// here so getSound() doesn't have to.
+	bool open(const void *data, unsigned int size) {
+		const unsigned char *bank = (const unsigned char *)data;
+		_data = 0;
+		_soundCount = 0;
+
+		if (size < kHeaderSize || bank[0] != 'S' || bank[1] != 'F' || bank[2] != 'X' || bank[3] != 'B')
+			return false;
+
+		if (readUint32LE(bank + 4) != kVersion)
+			return false;
+
+		unsigned int soundCount = readUint32LE(bank + 8);
+		if (soundCount > (size - kHeaderSize) / kRecordSize)
+			return false;
+
+		for (unsigned int i = 0; i < soundCount; i++) {
+			const unsigned char *record = bank + kHeaderSize + i * kRecordSize;
+			unsigned int offset = readUint32LE(record);
+			unsigned int length = readUint32LE(record + 4);
+
+			if (length != 0 && (offset > size || length > size - offset || (offset & (kAlignment - 1))))
+				return false;
+		}
+
+		_data = bank;
+		_soundCount = soundCount;
+		return true;
+	}
+
+	unsigned int getSoundCount() const { return _soundCount; }
+
+	// Get a view of sound number index (the entry number in the original
+	// archive)
+	bool getSound(unsigned int index, SFXBankSound &sound) const {
+		if (index >= _soundCount)
+			return false;
+
+		const unsigned char *record = _data + kHeaderSize + index * kRecordSize;
+		sound.length = readUint32LE(record + 4);
+		sound.data = sound.length ? _data + readUint32LE(record) : 0;
+		sound.rate = readUint32LE(record + 8);
+		sound.channels = readUint16LE(record + 12);
+		sound.bitsPerSample = readUint16LE(record + 14);
+		return true;
+	}
+
+private:
+	enum {
+		kHeaderSize = 16,
+		kRecordSize = 16,
+		kAlignment = 16,
+		kVersion = 1
+	};
+
+	static unsigned short readUint16LE(const unsigned char *data) {
+		return (data[1] << 8) | data[0];
+	}
+
+	static unsigned int readUint32LE(const unsigned char *data) {
+		return (readUint16LE(data + 2) << 16) | readUint16LE(data);
+	}
+
+	const unsigned char *_data;
+	unsigned int _soundCount;
+};
+
+#endif
@@ -22,11 +22,27 @@
 #include <cstdio>
 #include <cstring>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The SSSE3 kernels are picked at runtime, so they're only available with
+// compilers that let us build single functions for another instruction set
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define USE_SSSE3_KERNELS
+#include <tmmintrin.h>
+#endif
+
 // Standard types
 typedef unsigned char byte;
 typedef unsigned short uint16;
 typedef unsigned int uint32;
 
+// Constants
+enum {
+	kBufSize = 16384
+};
+
 // Helper functions for reading integers from the stream (maintaining endianness)
 byte readByte(FILE *file) {
 	byte b = 0;
@@ -138,6 +154,34 @@ void fillBMPHeaderValues(FILE *output, uint32 imageOffset, uint32 imageSize) {
 	writeUint32LE(output, imageSize);
 }
 
+// Seek to where row y of the bottom-up image lives and write it there, so
+// rows can be converted in the order they are stored in the TIM
+void writeBMPRow(FILE *output, uint32 imageOffset, uint32 stride, uint16 height, uint16 y, const byte *row) {
+	fseek(output, imageOffset + (height - 1 - y) * stride, SEEK_SET);
+	fwrite(row, 1, stride, output);
+}
+
+// Read one row of TIM data, zero filling whatever is missing from the file
+void readTIMRow(FILE *input, byte *row, uint32 length) {
+	uint32 count = fread(row, 1, length, input);
+
+	if (count < length)
+		memset(row + count, 0, length - count);
+}
+
+void copyData(FILE *in, FILE *out, uint32 length) {
+	byte *buf = new byte[kBufSize];
+
+	while (length > 0) {
+		uint32 chunkSize = (length < kBufSize) ? length : kBufSize;
+		fread(buf, chunkSize, 1, in);
+		fwrite(buf, chunkSize, 1, out);
+		length -= chunkSize;
+	}
+
+	delete[] buf;
+}
+
 // Functions to isolate the color channels and blow them up to 8-bit values
 
 inline byte isolateRedChannel(uint16 color) {
@@ -153,41 +197,174 @@ inline byte isolateBlueChannel(uint16 color) {
 }
 
 // 15-bit BGR
-byte *readTIMPalette(FILE *input, uint16 maxPaletteSize) {
-	byte *palette = new byte[256 * 4];
-	memset(palette, 0, 256 * 4);
-
-	/* uint32 clutSize = */ readUint32LE(input);
+// Reads every CLUT in the block into consecutive 256 entry palettes and
+// returns how many there were in clutCount. A CLUT row wider than the
+// image can address is split up into several palettes.
+byte *readTIMPalettes(FILE *input, uint16 maxPaletteSize, uint16 &clutCount) {
+	uint32 clutStart = ftell(input);
+	uint32 clutSize = readUint32LE(input);
 	/* uint16 palOrigX = */ readUint16LE(input);
 	/* uint16 palOrigY = */ readUint16LE(input);
 	uint16 colorCount = readUint16LE(input);
-	uint16 clutCount = readUint16LE(input);
+	uint16 clutRows = readUint16LE(input);
 
-	if (clutCount != 1) {
-		printf("Unsupported CLUT count %d\n", clutCount);
+	if (clutRows == 0 || colorCount == 0) {
+		printf("Empty CLUT block\n");
 		return 0;
 	}
 
+	uint16 palettesPerRow = 1;
+
 	if (colorCount > maxPaletteSize) {
-		printf("CLUT color count greater than possible %d > %d\n", colorCount, maxPaletteSize);
+		if (colorCount % maxPaletteSize != 0) {
+			printf("CLUT color count greater than possible %d > %d\n", colorCount, maxPaletteSize);
+			return 0;
+		}
+
+		palettesPerRow = colorCount / maxPaletteSize;
+		colorCount = maxPaletteSize;
+	}
+
+	// Both factors are 16-bit, so the product can't wrap in 32 bits
+	if ((uint32)clutRows * palettesPerRow > 0xffff) {
+		printf("Too many CLUTs: %d rows of %d\n", clutRows, palettesPerRow);
 		return 0;
 	}
 
-	for (uint16 i = 0; i < colorCount; i++) {
-		uint16 color = readUint16LE(input);
-		palette[i * 4] = isolateBlueChannel(color);
-		palette[i * 4 + 1] = isolateGreenChannel(color);
-		palette[i * 4 + 2] = isolateRedChannel(color);
+	clutCount = clutRows * palettesPerRow;
+	printf("CLUT Count = %d\n", clutCount);
+
+	byte *palettes = new byte[clutCount * 256 * 4];
+	memset(palettes, 0, clutCount * 256 * 4);
+
+	for (uint32 i = 0; i < clutCount; i++) {
+		byte *palette = palettes + i * 256 * 4;
+
+		for (uint16 j = 0; j < colorCount; j++) {
+			uint16 color = readUint16LE(input);
+			palette[j * 4] = isolateBlueChannel(color);
+			palette[j * 4 + 1] = isolateGreenChannel(color);
+			palette[j * 4 + 2] = isolateRedChannel(color);
+		}
+	}
+
+	// Skip any padding so we end up at the image block
+	fseek(input, clutStart + clutSize, SEEK_SET);
+	return palettes;
+}
+
+// Row kernels for the conversion loops
+
+// Split count packed bytes into two 4-bit indices each, low nibble first
+// as the GPU reads them
+void unpackNibbleRow(const byte *src, byte *dst, uint32 count) {
+	uint32 i = 0;
+
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi8(0x0f);
+
+	for (; i + 16 <= count; i += 16) {
+		__m128i packed = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+		__m128i lo = _mm_and_si128(packed, mask);
+		_mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi8(lo, hi));
+		_mm_storeu_si128((__m128i *)(dst + i * 2 + 16), _mm_unpackhi_epi8(lo, hi));
+	}
+#endif
+
+	for (; i < count; i++) {
+		dst[i * 2] = src[i] & 0xf;
+		dst[i * 2 + 1] = src[i] >> 4;
+	}
+}
+
+// Reverse the channel order of width 24-bit pixels (RGB <-> BGR)
+void swizzleRGBRowScalar(const byte *src, byte *dst, uint32 width) {
+	for (uint32 x = 0; x < width; x++) {
+		dst[x * 3] = src[x * 3 + 2];
+		dst[x * 3 + 1] = src[x * 3 + 1];
+		dst[x * 3 + 2] = src[x * 3];
+	}
+}
+
+#ifdef USE_SSSE3_KERNELS
+// Swizzles five pixels per shuffle. Each 16-byte store runs one byte past
+// the fifth pixel, which the next store (or the scalar tail) overwrites.
+__attribute__((target("ssse3")))
+void swizzleRGBRowSSSE3(const byte *src, byte *dst, uint32 width) {
+	const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, -128);
+	uint32 x = 0;
+
+	for (; x + 6 <= width; x += 5) {
+		__m128i pixels = _mm_loadu_si128((const __m128i *)(src + x * 3));
+		_mm_storeu_si128((__m128i *)(dst + x * 3), _mm_shuffle_epi8(pixels, shuffle));
+	}
+
+	swizzleRGBRowScalar(src + x * 3, dst + x * 3, width - x);
+}
+#endif
+
+typedef void (*SwizzleRowProc)(const byte *src, byte *dst, uint32 width);
+
+SwizzleRowProc getSwizzleRGBRowProc() {
+#ifdef USE_SSSE3_KERNELS
+	if (__builtin_cpu_supports("ssse3"))
+		return swizzleRGBRowSSSE3;
+#endif
+
+	return swizzleRGBRowScalar;
+}
+
+// Build the file name for palette variant n: "foo.bmp" becomes "foo_n.bmp"
+char *getVariantFilename(const char *outputName, uint16 n) {
+	const char *ext = strrchr(outputName, '.');
+	if (!ext || strchr(ext, '/') || strchr(ext, '\\'))
+		ext = outputName + strlen(outputName);
+
+	char *filename = new char[strlen(outputName) + 8];
+	memset(filename, 0, strlen(outputName) + 8);
+	memcpy(filename, outputName, ext - outputName);
+	sprintf(filename + (ext - outputName), "_%d%s", n, ext);
+	return filename;
+}
+
+// Write the remaining palettes as their own 8bpp BMPs. The pixel block is
+// identical for every variant, so it's copied back out of the first BMP
+// rather than converted again.
+bool writePaletteVariants(FILE *output, const char *outputName, uint16 width, uint16 height, uint32 imageSize, byte *palettes, uint16 clutCount) {
+	for (uint16 i = 1; i < clutCount; i++) {
+		char *filename = getVariantFilename(outputName, i);
+		FILE *variant = fopen(filename, "wb+");
+
+		if (!variant) {
+			printf("Could not open '%s' for writing\n", filename);
+			delete[] filename;
+			return false;
+		}
+
+		printf("Writing palette %d to %s\n", i, filename);
+		delete[] filename;
+
+		writeBMPHeader(variant, width, height, 8);
+		writeBMPPalette(variant, palettes + i * 256 * 4);
+
+		fseek(output, 54 + 256 * 4, SEEK_SET);
+		copyData(output, variant, imageSize);
+
+		fillBMPHeaderValues(variant, 54 + 256 * 4, imageSize);
+		fflush(variant);
+		fclose(variant);
 	}
 
-	return palette;
+	return true;
 }
 
 // 4bpp, paletted
-bool convertTIM4ToBMP(FILE *input, FILE *output) {
-	byte *palette = readTIMPalette(input, 16);
+bool convertTIM4ToBMP(FILE *input, FILE *output, const char *outputName) {
+	uint16 clutCount = 0;
+	byte *palettes = readTIMPalettes(input, 16, clutCount);
 
-	if (!palette)
+	if (!palettes)
 		return false;
 
 	/* uint32 fileSize = */ readUint32LE(input);
@@ -199,40 +376,41 @@ bool convertTIM4ToBMP(FILE *input, FILE *output) {
 	printf("Width = %d\n", width);
 	printf("Height = %d\n", height);
 
-	byte *pixels = new byte[width * height];
-
-	for (uint32 i = 0; i < width * height / 2; i++) {
-		byte val = readByte(input);
-		pixels[i * 2] = val >> 4;
-		pixels[i * 2 + 1] = val & 0xf;
-	}
-
 	writeBMPHeader(output, width, height, 8);
-	writeBMPPalette(output, palette);
+	writeBMPPalette(output, palettes);
 
 	const uint32 pitch = width;
 	const int extraDataLength = (pitch % 4) ? 4 - (pitch % 4) : 0;
+	const uint32 stride = pitch + extraDataLength;
+
+	// Only ever hold one row of the image
+	byte *packed = new byte[width / 2];
+	byte *row = new byte[stride];
+	memset(row, 0, stride);
 
-	for (int y = height - 1; y >= 0; y--) {
-		for (int x = 0; x < width; x++)
-			writeByte(output, pixels[x + width * y]);
+	for (uint16 y = 0; y < height; y++) {
+		readTIMRow(input, packed, width / 2);
+		unpackNibbleRow(packed, row, width / 2);
 
-		for (int i = 0; i < extraDataLength; i++)
-			writeByte(output, 0);
+		writeBMPRow(output, 54 + 256 * 4, stride, height, y, row);
 	}
 
-	fillBMPHeaderValues(output, 54 + 256 * 4, (pitch + extraDataLength) * height);
+	fillBMPHeaderValues(output, 54 + 256 * 4, stride * height);
 
-	delete[] pixels;
-	delete[] palette;
-	return true;
+	bool result = writePaletteVariants(output, outputName, width, height, stride * height, palettes, clutCount);
+
+	delete[] row;
+	delete[] packed;
+	delete[] palettes;
+	return result;
 }
 
 // 8bpp, paletted
-bool convertTIM8ToBMP(FILE *input, FILE *output) {
-	byte *palette = readTIMPalette(input, 256);
+bool convertTIM8ToBMP(FILE *input, FILE *output, const char *outputName) {
+	uint16 clutCount = 0;
+	byte *palettes = readTIMPalettes(input, 256, clutCount);
 
-	if (!palette)
+	if (!palettes)
 		return false;
 
 	/* uint32 fileSize = */ readUint32LE(input);
@@ -244,30 +422,29 @@ bool convertTIM8ToBMP(FILE *input, FILE *output) {
 	printf("Width = %d\n", width);
 	printf("Height = %d\n", height);
 
-	byte *pixels = new byte[width * height];
-
-	for (uint32 i = 0; i < width * height; i++)
-		pixels[i] = readByte(input);
-
 	writeBMPHeader(output, width, height, 8);
-	writeBMPPalette(output, palette);
+	writeBMPPalette(output, palettes);
 
 	const uint32 pitch = width;
 	const int extraDataLength = (pitch % 4) ? 4 - (pitch % 4) : 0;
+	const uint32 stride = pitch + extraDataLength;
 
-	for (int y = height - 1; y >= 0; y--) {
-		for (int x = 0; x < width; x++)
-			writeByte(output, pixels[x + width * y]);
+	// The indices can go straight out, only the padding needs adding
+	byte *row = new byte[stride];
+	memset(row, 0, stride);
 
-		for (int i = 0; i < extraDataLength; i++)
-			writeByte(output, 0);
+	for (uint16 y = 0; y < height; y++) {
+		readTIMRow(input, row, pitch);
+		writeBMPRow(output, 54 + 256 * 4, stride, height, y, row);
 	}
 
-	fillBMPHeaderValues(output, 54 + 256 * 4, (pitch + extraDataLength) * height);
+	fillBMPHeaderValues(output, 54 + 256 * 4, stride * height);
 
-	delete[] pixels;
-	delete[] palette;
-	return true;
+	bool result = writePaletteVariants(output, outputName, width, height, stride * height, palettes, clutCount);
+
+	delete[] row;
+	delete[] palettes;
+	return result;
 }
 
 // 15-bit BGR
@@ -281,30 +458,33 @@ bool convertTIM16ToBMP(FILE *input, FILE *output) {
 	printf("Width = %d\n", width);
 	printf("Height = %d\n", height);
 
-	uint16 *pixels = new uint16[width * height];
-	for (uint32 i = 0; i < width * height; i++)
-		pixels[i] = readUint16LE(input);
-
 	writeBMPHeader(output, width, height, 24);
 
 	const uint32 pitch = width * 3;
 	const int extraDataLength = (pitch % 4) ? 4 - (pitch % 4) : 0;
+	const uint32 stride = pitch + extraDataLength;
+
+	byte *src = new byte[width * 2];
+	byte *row = new byte[stride];
+	memset(row, 0, stride);
+
+	for (uint16 y = 0; y < height; y++) {
+		readTIMRow(input, src, width * 2);
 
-	for (int y = height - 1; y >= 0; y--) {
-		for (int x = 0; x < width; x++) {
-			uint16 color = pixels[x + width * y];
-			writeByte(output, isolateBlueChannel(color));
-			writeByte(output, isolateGreenChannel(color));
-			writeByte(output, isolateRedChannel(color));
+		for (uint32 x = 0; x < width; x++) {
+			uint16 color = src[x * 2] | (src[x * 2 + 1] << 8);
+			row[x * 3] = isolateBlueChannel(color);
+			row[x * 3 + 1] = isolateGreenChannel(color);
+			row[x * 3 + 2] = isolateRedChannel(color);
 		}
 
-		for (int i = 0; i < extraDataLength; i++)
-			writeByte(output, 0);
+		writeBMPRow(output, 54, stride, height, y, row);
 	}
 
-	fillBMPHeaderValues(output, 54, (pitch + extraDataLength) * height);
+	fillBMPHeaderValues(output, 54, stride * height);
 
-	delete[] pixels;
+	delete[] row;
+	delete[] src;
 	return true;
 }
 
@@ -313,39 +493,42 @@ bool convertTIM24ToBMP(FILE *input, FILE *output) {
 	/* uint32 fileSize = */ readUint32LE(input);
 	/* uint16 origX = */ readUint16LE(input);
 	/* uint16 origY = */ readUint16LE(input);
-	uint16 width = readUint16LE(input) * 2 / 3;
+	uint16 rowWords = readUint16LE(input);
+	uint16 width = rowWords * 2 / 3;
 	uint16 height = readUint16LE(input);
 
 	printf("Width = %d\n", width);
 	printf("Height = %d\n", height);
 
-	byte *pixels = new byte[width * height * 3];
-	for (uint32 i = 0; i < width * height * 3; i++)
-		pixels[i] = readByte(input);
-
 	writeBMPHeader(output, width, height, 24);
 
 	const uint32 pitch = width * 3;
 	const int extraDataLength = (pitch % 4) ? 4 - (pitch % 4) : 0;
+	const uint32 stride = pitch + extraDataLength;
 
-	for (int y = height - 1; y >= 0; y--) {
-		for (int x = 0; x < width; x++) {
-			writeByte(output, pixels[y * pitch + x * 3 + 2]);
-			writeByte(output, pixels[y * pitch + x * 3 + 1]);
-			writeByte(output, pixels[y * pitch + x * 3]);
-		}
+	SwizzleRowProc swizzleRow = getSwizzleRGBRowProc();
+
+	// TIM rows are a whole number of 16-bit words, which may be a byte
+	// more than the pixels themselves take up
+	byte *src = new byte[rowWords * 2];
+	byte *row = new byte[stride];
+	memset(row, 0, stride);
+
+	for (uint16 y = 0; y < height; y++) {
+		readTIMRow(input, src, rowWords * 2);
+		swizzleRow(src, row, width);
 
-		for (int i = 0; i < extraDataLength; i++)
-			writeByte(output, 0);
+		writeBMPRow(output, 54, stride, height, y, row);
 	}
 
-	fillBMPHeaderValues(output, 54, (pitch + extraDataLength) * height);
+	fillBMPHeaderValues(output, 54, stride * height);
 
-	delete[] pixels;
+	delete[] row;
+	delete[] src;
 	return true;
 }
 
-bool convertTIMToBMP(FILE *input, FILE *output) {
+bool convertTIMToBMP(FILE *input, FILE *output, const char *outputName) {
 	uint32 tag = readUint32LE(input);
 	uint32 version = readUint32LE(input);
 
@@ -357,13 +540,13 @@ bool convertTIMToBMP(FILE *input, FILE *output) {
 	switch (version) {
 		case 8: // 4bpp (with CLUT)
 			printf("Found 4bpp (with CLUT) TIM image\n");
-			return convertTIM4ToBMP(input, output);
+			return convertTIM4ToBMP(input, output, outputName);
 		case 0: // 4bpp (without CLUT)
 			printf("Unhandled 4bpp (without CLUT) image\n");
 			return false;
 		case 9: // 8bpp (with CLUT)
 			printf("Found 8bpp (with CLUT) TIM image\n");
-			return convertTIM8ToBMP(input, output);
+			return convertTIM8ToBMP(input, output, outputName);
 		case 1: // 8bpp (without CLUT)
 			printf("Unhandled 8bpp (without CLUT) image\n");
 			return false;
@@ -403,7 +586,7 @@ int main(int argc, const char **argv) {
 		return 1;
 	}
 
-	if (!convertTIMToBMP(input, output))
+	if (!convertTIMToBMP(input, output, argv[2]))
 		return 1;
 
 	fclose(input);
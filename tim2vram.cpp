@@ -0,0 +1,399 @@
+/* tim2vram.cpp -- Compose PlayStation TIM images into a VRAM image
+ * Copyright (c) 2012 Matthew Hoops (clone2727)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+// Thanks to http://www.romhacking.net/docs/timgfx.txt for the format information
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Standard types
+typedef unsigned char byte;
+typedef unsigned short uint16;
+typedef unsigned int uint32;
+
+// Constants
+enum {
+	kVRAMWidth = 1024, // In 16-bit units
+	kVRAMHeight = 512,
+	kTIMTag = 0x10
+};
+
+// Helper functions for reading integers from the stream (maintaining endianness)
+byte readByte(FILE *file) {
+	byte b = 0;
+	fread(&b, 1, 1, file);
+	return b;
+}
+
+void writeByte(FILE *file, byte b) {
+	fwrite(&b, 1, 1, file);
+}
+
+void writeUint16LE(FILE *file, uint16 x) {
+	writeByte(file, x & 0xff);
+	writeByte(file, x >> 8);
+}
+
+void writeUint32LE(FILE *file, uint32 x) {
+	writeUint16LE(file, x & 0xffff);
+	writeUint16LE(file, x >> 16);
+}
+
+void writeUint16BE(FILE *file, uint16 x) {
+	writeByte(file, x >> 8);
+	writeByte(file, x & 0xff);
+}
+
+uint16 READ_LE_UINT16(const byte *data) {
+	return (*(data + 1) << 8) | *data;
+}
+
+uint32 READ_LE_UINT32(const byte *data) {
+	return (READ_LE_UINT16(data + 2) << 16) | READ_LE_UINT16(data);
+}
+
+uint32 getFileSize(FILE *file) {
+	uint32 pos = ftell(file);
+	fseek(file, 0, SEEK_END);
+	uint32 size = ftell(file);
+	fseek(file, pos, SEEK_SET);
+	return size;
+}
+
+void writeBMPHeader(FILE *output, uint16 width, uint16 height, uint16 bitsPerPixel) {
+	// Main Header
+	writeUint16BE(output, 'BM');
+	writeUint32LE(output, 0); // Size, will fill in later
+	writeUint16LE(output, 0); // Reserved
+	writeUint16LE(output, 0); // Reserved
+	writeUint32LE(output, 0); // Image offset, will fill in later
+
+	// Info Header
+	writeUint32LE(output, 40);
+	writeUint32LE(output, width);
+	writeUint32LE(output, height);
+	writeUint16LE(output, 1);
+	writeUint16LE(output, bitsPerPixel);
+	writeUint32LE(output, 0);
+	writeUint32LE(output, 0); // Image size, will fill in later
+	writeUint32LE(output, 72); // 72 dpi sounds fine to me
+	writeUint32LE(output, 72); // as above
+
+	// Only write the empty palette if we're not in paletted mode. The
+	// palette header will be written in writeBMPPalette() otherwise.
+	if (bitsPerPixel > 8) {
+		writeUint32LE(output, 0);
+		writeUint32LE(output, 0);
+	}
+}
+
+void fillBMPHeaderValues(FILE *output, uint32 imageOffset, uint32 imageSize) {
+	fflush(output);
+	uint32 fileSize = getFileSize(output);
+
+	fseek(output, 2, SEEK_SET);
+	fflush(output);
+	writeUint32LE(output, fileSize);
+	fflush(output);
+
+	fseek(output, 10, SEEK_SET);
+	fflush(output);
+	writeUint32LE(output, imageOffset);
+	fflush(output);
+
+	fseek(output, 34, SEEK_SET);
+	fflush(output);
+	writeUint32LE(output, imageSize);
+}
+
+// Functions to isolate the color channels and blow them up to 8-bit values
+
+inline byte isolateRedChannel(uint16 color) {
+	return (color & 0x1f) << 3;
+}
+
+inline byte isolateGreenChannel(uint16 color) {
+	return (color & 0x3e0) >> 2;
+}
+
+inline byte isolateBlueChannel(uint16 color) {
+	return (color & 0x7c00) >> 7;
+}
+
+// Validate a TIM block header (CLUT or image) at data and return the size
+// of the block, or 0 if it doesn't look sane.
+uint32 checkTIMBlock(const byte *data, uint32 size) {
+	if (size < 12)
+		return 0;
+
+	uint32 blockSize = READ_LE_UINT32(data);
+	uint16 x = READ_LE_UINT16(data + 4);
+	uint16 y = READ_LE_UINT16(data + 6);
+	uint16 width = READ_LE_UINT16(data + 8);
+	uint16 height = READ_LE_UINT16(data + 10);
+
+	if (width == 0 || height == 0 || x >= kVRAMWidth || y >= kVRAMHeight)
+		return 0;
+
+	// Nothing bigger than VRAM can be uploaded, and this also keeps the
+	// size calculation below from wrapping around
+	if (width > kVRAMWidth || height > kVRAMHeight)
+		return 0;
+
+	if (blockSize != 12 + (uint32)width * height * 2 || blockSize > size)
+		return 0;
+
+	return blockSize;
+}
+
+// Copy a TIM block into VRAM at its framebuffer coordinates. Transfers
+// wrap around the edges of VRAM, just like on the real hardware.
+void placeTIMBlock(const byte *data, uint16 *vram) {
+	uint16 x = READ_LE_UINT16(data + 4);
+	uint16 y = READ_LE_UINT16(data + 6);
+	uint16 width = READ_LE_UINT16(data + 8);
+	uint16 height = READ_LE_UINT16(data + 10);
+	const byte *src = data + 12;
+
+	for (uint32 j = 0; j < height; j++) {
+		uint16 *row = vram + ((y + j) % kVRAMHeight) * kVRAMWidth;
+
+		for (uint32 i = 0; i < width; i++, src += 2)
+			row[(x + i) % kVRAMWidth] = READ_LE_UINT16(src);
+	}
+}
+
+// Place the TIM starting at data into VRAM. Returns the length of the TIM,
+// or 0 if there's no valid TIM at this position.
+uint32 placeTIM(const byte *data, uint32 size, uint16 *vram) {
+	if (size < 8 || READ_LE_UINT32(data) != kTIMTag)
+		return 0;
+
+	uint32 flags = READ_LE_UINT32(data + 4);
+	if ((flags & ~0xB) != 0 || ((flags & 3) == 3 && (flags & 8)))
+		return 0;
+
+	uint32 offset = 8;
+	uint32 clutOffset = 0;
+
+	if (flags & 8) {
+		uint32 clutSize = checkTIMBlock(data + offset, size - offset);
+		if (!clutSize)
+			return 0;
+
+		clutOffset = offset;
+		offset += clutSize;
+	}
+
+	uint32 imageSize = checkTIMBlock(data + offset, size - offset);
+	if (!imageSize)
+		return 0;
+
+	// Only touch VRAM once the whole TIM has been validated
+	if (flags & 8)
+		placeTIMBlock(data + clutOffset, vram);
+
+	placeTIMBlock(data + offset, vram);
+	return offset + imageSize;
+}
+
+// Load a whole TIM file (or, when scanning, every TIM found in the file)
+// into VRAM. Later TIMs overwrite earlier ones where they overlap.
+bool loadTIMFile(const char *filename, uint16 *vram, bool scan) {
+	FILE *input = fopen(filename, "rb");
+	if (!input) {
+		printf("Could not open '%s' for reading\n", filename);
+		return false;
+	}
+
+	uint32 size = getFileSize(input);
+	byte *data = new byte[size];
+
+	if (fread(data, 1, size, input) != size) {
+		printf("Failed to read '%s'\n", filename);
+		delete[] data;
+		fclose(input);
+		return false;
+	}
+
+	fclose(input);
+
+	uint32 timCount = 0;
+
+	if (scan) {
+		// TIMs are always 4-byte aligned within rips and archives
+		for (uint32 offset = 0; offset + 8 <= size; ) {
+			uint32 length = placeTIM(data + offset, size - offset, vram);
+
+			if (length) {
+				timCount++;
+				offset += (length + 3) & ~3;
+			} else {
+				offset += 4;
+			}
+		}
+	} else if (placeTIM(data, size, vram)) {
+		timCount++;
+	}
+
+	delete[] data;
+
+	if (timCount == 0) {
+		printf("No TIM images found in '%s'\n", filename);
+		return false;
+	}
+
+	printf("Placed %d TIM image(s) from %s\n", timCount, filename);
+	return true;
+}
+
+// Render VRAM as 15-bit direct color
+void renderVRAM16(FILE *output, const uint16 *vram) {
+	writeBMPHeader(output, kVRAMWidth, kVRAMHeight, 24);
+
+	byte *row = new byte[kVRAMWidth * 3];
+
+	for (int y = kVRAMHeight - 1; y >= 0; y--) {
+		const uint16 *src = vram + y * kVRAMWidth;
+
+		for (uint32 x = 0; x < kVRAMWidth; x++) {
+			row[x * 3] = isolateBlueChannel(src[x]);
+			row[x * 3 + 1] = isolateGreenChannel(src[x]);
+			row[x * 3 + 2] = isolateRedChannel(src[x]);
+		}
+
+		fwrite(row, 1, kVRAMWidth * 3, output);
+	}
+
+	delete[] row;
+	fillBMPHeaderValues(output, 54, kVRAMWidth * 3 * kVRAMHeight);
+}
+
+// Render VRAM as 4bpp or 8bpp indices through the CLUT at (clutX, clutY).
+// Indices are unpacked low nibble/byte first, as the GPU samples them.
+void renderVRAMPaletted(FILE *output, const uint16 *vram, uint16 bitsPerPixel, uint16 clutX, uint16 clutY) {
+	const uint32 pixelsPerWord = 16 / bitsPerPixel;
+	const uint32 width = kVRAMWidth * pixelsPerWord;
+	const uint16 mask = (1 << bitsPerPixel) - 1;
+
+	byte palette[256 * 4];
+	memset(palette, 0, sizeof(palette));
+
+	for (uint32 i = 0; i <= mask; i++) {
+		uint16 color = vram[clutY * kVRAMWidth + (clutX + i) % kVRAMWidth];
+		palette[i * 4] = isolateBlueChannel(color);
+		palette[i * 4 + 1] = isolateGreenChannel(color);
+		palette[i * 4 + 2] = isolateRedChannel(color);
+	}
+
+	writeBMPHeader(output, width, kVRAMHeight, 8);
+	writeUint32LE(output, 256);
+	writeUint32LE(output, 256);
+	fwrite(palette, 1, sizeof(palette), output);
+
+	byte *row = new byte[width];
+
+	for (int y = kVRAMHeight - 1; y >= 0; y--) {
+		const uint16 *src = vram + y * kVRAMWidth;
+
+		for (uint32 x = 0; x < width; x++)
+			row[x] = (src[x / pixelsPerWord] >> ((x % pixelsPerWord) * bitsPerPixel)) & mask;
+
+		fwrite(row, 1, width, output);
+	}
+
+	delete[] row;
+	fillBMPHeaderValues(output, 54 + 256 * 4, width * kVRAMHeight);
+}
+
+int main(int argc, const char **argv) {
+	printf("\nTIM to VRAM Compositor\n");
+	printf("Places PlayStation TIM files at their VRAM coordinates and renders a BMP\n");
+	printf("Written by Matthew Hoops (clone2727)\n");
+	printf("See license.txt for the license\n\n");
+
+	bool scan = false, showUsage = false;
+	uint16 bitsPerPixel = 16, clutX = 0, clutY = 0;
+	int arg = 1;
+
+	for (; arg < argc && argv[arg][0] == '-'; arg++) {
+		if (!strcmp(argv[arg], "-scan")) {
+			scan = true;
+		} else if (!strcmp(argv[arg], "-clut")) {
+			if (arg + 3 >= argc) {
+				showUsage = true;
+				break;
+			}
+
+			clutX = atoi(argv[arg + 1]);
+			clutY = atoi(argv[arg + 2]);
+			bitsPerPixel = atoi(argv[arg + 3]);
+			arg += 3;
+		} else {
+			break;
+		}
+	}
+
+	if (showUsage || argc - arg < 2) {
+		printf("Usage: %s [-scan] [-clut <x> <y> <4|8>] <output> <tim> [tim ...]\n", argv[0]);
+		printf("  -scan    Search the inputs for TIMs at any 4-byte aligned offset\n");
+		printf("  -clut    Render VRAM as 4bpp/8bpp through the CLUT at (x, y)\n");
+		return 0;
+	}
+
+	if (bitsPerPixel != 4 && bitsPerPixel != 8 && bitsPerPixel != 16) {
+		printf("Invalid CLUT view depth %d\n", bitsPerPixel);
+		return 1;
+	}
+
+	if (clutX >= kVRAMWidth || clutY >= kVRAMHeight) {
+		printf("CLUT position (%d, %d) is outside of VRAM\n", clutX, clutY);
+		return 1;
+	}
+
+	uint16 *vram = new uint16[kVRAMWidth * kVRAMHeight];
+	memset(vram, 0, kVRAMWidth * kVRAMHeight * 2);
+
+	for (int i = arg + 1; i < argc; i++) {
+		if (!loadTIMFile(argv[i], vram, scan)) {
+			delete[] vram;
+			return 1;
+		}
+	}
+
+	FILE *output = fopen(argv[arg], "wb+");
+	if (!output) {
+		printf("Could not open '%s' for writing\n", argv[arg]);
+		delete[] vram;
+		return 1;
+	}
+
+	if (bitsPerPixel == 16)
+		renderVRAM16(output, vram);
+	else
+		renderVRAMPaletted(output, vram, bitsPerPixel, clutX, clutY);
+
+	fflush(output);
+	fclose(output);
+	delete[] vram;
+
+	printf("\nAll Done!\n");
+	return 0;
+}
@@ -0,0 +1,237 @@
+/* vab.h -- Read PlayStation VAB sound banks
+ * Copyright (c) 2012 Matthew Hoops (clone2727)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+// The VH parsing and SPU ADPCM decoding shared by vab2wav and seqsynth.
+// A VAB is a VH (the program and tone tables plus the size of every VAG)
+// directly followed by a VB (the VAGs themselves); some games keep the
+// two in separate files.
+
+#ifndef VAB_H
+#define VAB_H
+
+#include <cstdio>
+#include <cstring>
+
+// Standard types
+typedef unsigned char byte;
+typedef unsigned short uint16;
+typedef unsigned int uint32;
+typedef signed short int16;
+
+enum {
+	kMaxPrograms = 128,
+	kTonesPerProgram = 16,
+	kMaxVAGs = 256,
+	kVHHeaderSize = 32,
+	kVHProgramSize = 16,
+	kVHToneSize = 32,
+	kADPCMBlockSize = 16,
+	kSamplesPerBlock = 28
+};
+
+struct ProgramAttributes {
+	byte toneCount;
+	byte volume;
+	byte priority;
+	byte mode;
+	byte pan;
+	uint16 attributes;
+};
+
+struct ToneAttributes {
+	byte priority;
+	byte mode;
+	byte volume;
+	byte pan;
+	byte center;  ///< The note the VAG plays at its original pitch
+	byte shift;   ///< Fine tuning for the center note
+	byte minNote;
+	byte maxNote;
+	byte pitchBendMin;
+	byte pitchBendMax;
+	uint16 adsr1;
+	uint16 adsr2;
+	uint16 program;
+	uint16 vag;   ///< 1-based
+};
+
+struct VABHeader {
+	uint32 version;
+	uint32 id;
+	uint16 programCount;
+	uint16 toneCount;
+	uint16 vagCount;
+	byte volume;
+	byte pan;
+
+	ProgramAttributes programs[kMaxPrograms];
+	ToneAttributes *tones; ///< kTonesPerProgram per program in the file
+	uint32 vagSizes[kMaxVAGs];
+};
+
+inline uint16 readVABUint16(const byte *data) {
+	return (data[1] << 8) | data[0];
+}
+
+inline uint32 readVABUint32(const byte *data) {
+	return (readVABUint16(data + 2) << 16) | readVABUint16(data);
+}
+
+// Read size bytes, zero filling whatever is missing from the file
+inline void readVABRecord(FILE *input, byte *data, uint32 size) {
+	uint32 count = fread(data, 1, size, input);
+
+	if (count < size)
+		memset(data + count, 0, size - count);
+}
+
+// Read the VH part of a VAB. The tone table has a block of 16 tones for
+// each program that's actually in use.
+inline bool readVH(FILE *input, VABHeader &header) {
+	byte data[kVHHeaderSize];
+	readVABRecord(input, data, kVHHeaderSize);
+
+	if (memcmp(data, "pBAV", 4)) {
+		printf("VABp tag not found\n");
+		return false;
+	}
+
+	header.version = readVABUint32(data + 4);
+	header.id = readVABUint32(data + 8);
+	header.programCount = readVABUint16(data + 18);
+	header.toneCount = readVABUint16(data + 20);
+	header.vagCount = readVABUint16(data + 22);
+	header.volume = data[24];
+	header.pan = data[25];
+
+	if (header.programCount > kMaxPrograms || header.vagCount >= kMaxVAGs) {
+		printf("Bad VAB header: %d programs, %d VAGs\n", header.programCount, header.vagCount);
+		return false;
+	}
+
+	for (uint32 i = 0; i < kMaxPrograms; i++) {
+		ProgramAttributes &program = header.programs[i];
+		readVABRecord(input, data, kVHProgramSize);
+
+		program.toneCount = data[0];
+		program.volume = data[1];
+		program.priority = data[2];
+		program.mode = data[3];
+		program.pan = data[4];
+		program.attributes = readVABUint16(data + 6);
+	}
+
+	header.tones = new ToneAttributes[header.programCount * kTonesPerProgram];
+
+	for (uint32 i = 0; i < (uint32)header.programCount * kTonesPerProgram; i++) {
+		ToneAttributes &tone = header.tones[i];
+		readVABRecord(input, data, kVHToneSize);
+
+		tone.priority = data[0];
+		tone.mode = data[1];
+		tone.volume = data[2];
+		tone.pan = data[3];
+		tone.center = data[4];
+		tone.shift = data[5];
+		tone.minNote = data[6];
+		tone.maxNote = data[7];
+		// 8-11: Vibrato and portamento, unused by the library
+		tone.pitchBendMin = data[12];
+		tone.pitchBendMax = data[13];
+		tone.adsr1 = readVABUint16(data + 16);
+		tone.adsr2 = readVABUint16(data + 18);
+		tone.program = readVABUint16(data + 20);
+		tone.vag = readVABUint16(data + 22);
+	}
+
+	// The size table is stored in units of 8 bytes, entry 0 is unused
+	byte sizes[kMaxVAGs * 2];
+	readVABRecord(input, sizes, sizeof(sizes));
+
+	for (uint32 i = 0; i < kMaxVAGs; i++)
+		header.vagSizes[i] = readVABUint16(sizes + i * 2) << 3;
+
+	return true;
+}
+
+// SPU ADPCM prediction filters, in 1/64ths
+static const int s_adpcmFilters[5][2] = {
+	{   0,   0 },
+	{  60,   0 },
+	{ 115, -52 },
+	{  98, -55 },
+	{ 122, -60 }
+};
+
+// Decode SPU ADPCM: 16-byte blocks of a shift/filter byte, a flags byte
+// and 28 4-bit samples, low nibble first. Stops at the block flagged as the
+// end. loopStart is set to the sample the loop starts at, or -1 if the
+// sample doesn't loop.
+inline uint32 decodeSPUADPCM(const byte *src, uint32 size, int16 *dst, int &loopStart) {
+	int s1 = 0, s2 = 0;
+	int loopPoint = -1;
+	uint32 count = 0;
+
+	loopStart = -1;
+
+	for (uint32 offset = 0; offset + kADPCMBlockSize <= size; offset += kADPCMBlockSize) {
+		const byte *block = src + offset;
+		int shift = block[0] & 0xf;
+		int filter = (block[0] >> 4) & 7;
+		byte flags = block[1];
+
+		// Shift values above 12 act like 9 on the real hardware
+		if (shift > 12)
+			shift = 9;
+
+		if (filter > 4)
+			filter = 4;
+
+		if (flags & 4)
+			loopPoint = count;
+
+		const int f0 = s_adpcmFilters[filter][0];
+		const int f1 = s_adpcmFilters[filter][1];
+
+		for (uint32 i = 0; i < kSamplesPerBlock; i++) {
+			int nibble = (i & 1) ? (block[2 + i / 2] >> 4) : (block[2 + i / 2] & 0xf);
+			int sample = ((int16)(nibble << 12) >> shift) + ((s1 * f0 + s2 * f1 + 32) >> 6);
+
+			if (sample > 32767)
+				sample = 32767;
+			else if (sample < -32768)
+				sample = -32768;
+
+			dst[count++] = sample;
+			s2 = s1;
+			s1 = sample;
+		}
+
+		if (flags & 1) {
+			// End flag plus repeat flag means jump back to the loop point
+			if (flags & 2)
+				loopStart = loopPoint;
+			break;
+		}
+	}
+
+	return count;
+}
+
+#endif
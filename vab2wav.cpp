@@ -0,0 +1,362 @@
+/* vab2wav.cpp -- Extract PlayStation VAB sound banks to WAVE
+ * Copyright (c) 2012 Matthew Hoops (clone2727)
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <cstdio>
+#include <cstring>
+
+// Samples are decoded on a pool of threads where pthreads are available,
+// and one after another everywhere else
+#ifndef _WIN32
+#define USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "vab.h"
+
+// Standard types
+typedef unsigned char byte;
+typedef unsigned short uint16;
+typedef unsigned int uint32;
+typedef signed short int16;
+
+// Constants
+enum {
+	kOutputRate = 44100 // VAGs have no rate of their own; this is the SPU's
+};
+
+// Helper functions for reading integers from the stream (maintaining endianness)
+byte readByte(FILE *file) {
+	byte b = 0;
+	fread(&b, 1, 1, file);
+	return b;
+}
+
+uint16 readUint16LE(FILE *file) {
+	uint16 x = readByte(file);
+	return x | readByte(file) << 8;
+}
+
+uint32 readUint32LE(FILE *file) {
+	uint16 x = readUint16LE(file);
+	return x | readUint16LE(file) << 16;
+}
+
+void writeByte(FILE *file, byte b) {
+	fwrite(&b, 1, 1, file);
+}
+
+void writeUint16LE(FILE *file, uint16 x) {
+	writeByte(file, x & 0xff);
+	writeByte(file, x >> 8);
+}
+
+void writeUint32LE(FILE *file, uint32 x) {
+	writeUint16LE(file, x & 0xffff);
+	writeUint16LE(file, x >> 16);
+}
+
+void writeUint16BE(FILE *file, uint16 x) {
+	writeByte(file, x >> 8);
+	writeByte(file, x & 0xff);
+}
+
+void writeUint32BE(FILE *file, uint32 x) {
+	writeUint16BE(file, x >> 16);
+	writeUint16BE(file, x & 0xffff);
+}
+
+uint32 getFileSize(FILE *file) {
+	uint32 pos = ftell(file);
+	fseek(file, 0, SEEK_END);
+	uint32 size = ftell(file);
+	fseek(file, pos, SEEK_SET);
+	return size;
+}
+
+void writeWave(FILE *output, const int16 *samples, uint32 sampleCount) {
+	writeUint32BE(output, 'RIFF');
+	writeUint32LE(output, sampleCount * 2 + 36);
+	writeUint32BE(output, 'WAVE');
+	writeUint32BE(output, 'fmt ');
+	writeUint32LE(output, 16);
+	writeUint16LE(output, 1);
+	writeUint16LE(output, 1);
+	writeUint32LE(output, kOutputRate);
+	writeUint32LE(output, kOutputRate * 2);
+	writeUint16LE(output, 2);
+	writeUint16LE(output, 16);
+	writeUint32BE(output, 'data');
+	writeUint32LE(output, sampleCount * 2);
+
+	// WAVE is little endian, so convert the whole block first
+	byte *data = new byte[sampleCount * 2];
+	for (uint32 i = 0; i < sampleCount; i++) {
+		data[i * 2] = samples[i] & 0xff;
+		data[i * 2 + 1] = (samples[i] >> 8) & 0xff;
+	}
+
+	fwrite(data, 1, sampleCount * 2, output);
+	delete[] data;
+}
+
+void printPrograms(const VABHeader &header) {
+	printf("Programs:\n");
+
+	uint32 toneBlock = 0;
+
+	for (uint32 i = 0; i < kMaxPrograms && toneBlock < header.programCount; i++) {
+		const ProgramAttributes &program = header.programs[i];
+		if (program.toneCount == 0)
+			continue;
+
+		printf("Program %d: %d tone(s), volume %d, pan %d\n", i, program.toneCount, program.volume, program.pan);
+
+		for (uint32 j = 0; j < program.toneCount && j < kTonesPerProgram; j++) {
+			const ToneAttributes &tone = header.tones[toneBlock * kTonesPerProgram + j];
+			printf("  Tone %2d: VAG %3d, notes %3d-%3d, center %3d.%03d, volume %3d, pan %3d, ADSR %04x %04x\n",
+					j, tone.vag, tone.minNote, tone.maxNote, tone.center, tone.shift, tone.volume, tone.pan, tone.adsr1, tone.adsr2);
+		}
+
+		toneBlock++;
+	}
+
+	printf("\n");
+}
+
+// One VAG to decode and write out. The results are filled in by whichever
+// thread picks it up.
+struct VAGJob {
+	uint32 offset;
+	uint32 size;
+	uint32 sampleCount;
+	int loopStart;
+	bool written;
+};
+
+struct DecodeContext {
+	const byte *body;
+	VAGJob *jobs;
+	uint32 jobCount;
+	uint32 nextJob;
+	uint32 bufferSize; ///< In samples, enough for the biggest VAG
+#ifdef USE_THREADS
+	pthread_mutex_t lock;
+#endif
+};
+
+bool takeJob(DecodeContext &context, uint32 &index) {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&context.lock);
+#endif
+
+	index = context.nextJob;
+	bool found = index < context.jobCount;
+	if (found)
+		context.nextJob++;
+
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&context.lock);
+#endif
+
+	return found;
+}
+
+// Keep taking VAGs until there are none left. Every VAG goes to its own
+// file, so the workers never have to wait for each other to write.
+void *decodeWorker(void *arg) {
+	DecodeContext &context = *(DecodeContext *)arg;
+	int16 *samples = new int16[context.bufferSize];
+	uint32 index;
+
+	while (takeJob(context, index)) {
+		VAGJob &job = context.jobs[index];
+		job.sampleCount = decodeSPUADPCM(context.body + job.offset, job.size, samples, job.loopStart);
+
+		char filename[32];
+		sprintf(filename, "%d.wav", index + 1);
+
+		FILE *output = fopen(filename, "wb");
+		if (!output)
+			continue;
+
+		writeWave(output, samples, job.sampleCount);
+
+		fflush(output);
+		fclose(output);
+		job.written = true;
+	}
+
+	delete[] samples;
+	return 0;
+}
+
+uint32 getThreadCount(uint32 jobCount) {
+	uint32 threadCount = 1;
+
+#ifdef USE_THREADS
+	long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpuCount > 1)
+		threadCount = cpuCount;
+#endif
+
+	return (threadCount < jobCount) ? threadCount : (jobCount ? jobCount : 1);
+}
+
+// VAGs don't depend on each other, so they're decoded and written in
+// parallel. The decode itself stays serial within a VAG. This thread
+// works through the jobs alongside the extra ones.
+void decodeAllSamples(DecodeContext &context) {
+#ifdef USE_THREADS
+	pthread_mutex_init(&context.lock, 0);
+
+	uint32 extraThreads = getThreadCount(context.jobCount) - 1;
+	pthread_t *threads = new pthread_t[extraThreads + 1];
+	uint32 started = 0;
+
+	for (; started < extraThreads; started++)
+		if (pthread_create(&threads[started], 0, decodeWorker, &context) != 0)
+			break;
+
+	decodeWorker(&context);
+
+	for (uint32 i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+
+	delete[] threads;
+	pthread_mutex_destroy(&context.lock);
+#else
+	decodeWorker(&context);
+#endif
+}
+
+bool extractAllSamples(FILE *vh, FILE *vb) {
+	VABHeader header;
+	header.tones = 0;
+
+	if (!readVH(vh, header)) {
+		delete[] header.tones;
+		return false;
+	}
+
+	printf("VAB id %d, version %d: %d programs, %d tones, %d VAGs\n\n", header.id, header.version,
+			header.programCount, header.toneCount, header.vagCount);
+
+	printPrograms(header);
+
+	// Read the whole body in one go and decode from memory
+	uint32 bodySize = 0;
+	for (uint32 i = 1; i <= header.vagCount; i++)
+		bodySize += header.vagSizes[i];
+
+	byte *body = new byte[bodySize];
+	if (fread(body, 1, bodySize, vb) != bodySize) {
+		printf("VB data is truncated\n");
+		delete[] body;
+		delete[] header.tones;
+		return false;
+	}
+
+	// Each block decodes to 28 samples, so the biggest VAG bounds the buffer
+	uint32 maxSize = 0;
+	for (uint32 i = 1; i <= header.vagCount; i++)
+		if (header.vagSizes[i] > maxSize)
+			maxSize = header.vagSizes[i];
+
+	DecodeContext context;
+	context.body = body;
+	context.jobs = new VAGJob[header.vagCount];
+	context.jobCount = header.vagCount;
+	context.nextJob = 0;
+	context.bufferSize = maxSize / kADPCMBlockSize * kSamplesPerBlock;
+
+	uint32 offset = 0;
+	for (uint32 i = 0; i < header.vagCount; i++) {
+		context.jobs[i].offset = offset;
+		context.jobs[i].size = header.vagSizes[i + 1];
+		context.jobs[i].sampleCount = 0;
+		context.jobs[i].loopStart = -1;
+		context.jobs[i].written = false;
+		offset += header.vagSizes[i + 1];
+	}
+
+	decodeAllSamples(context);
+
+	// Report in VAG order once everything is done
+	bool allDone = true;
+
+	for (uint32 i = 0; i < header.vagCount; i++) {
+		const VAGJob &job = context.jobs[i];
+
+		if (!job.written) {
+			printf("Could not open '%d.wav' for writing\n", i + 1);
+			allDone = false;
+		} else if (job.loopStart >= 0) {
+			printf("Extracted %d.wav (%d samples, loops from %d)\n", i + 1, job.sampleCount, job.loopStart);
+		} else {
+			printf("Extracted %d.wav (%d samples)\n", i + 1, job.sampleCount);
+		}
+	}
+
+	delete[] context.jobs;
+	delete[] body;
+	delete[] header.tones;
+	return allDone;
+}
+
+int main(int argc, const char **argv) {
+	printf("\nPSX VAB Sound Bank Extractor\n");
+	printf("Converts samples from PlayStation VAB (or VH/VB) sound banks to WAVE\n");
+	printf("Written by Matthew Hoops (clone2727)\n");
+	printf("See license.txt for the license\n\n");
+
+	if (argc < 2) {
+		printf("Usage: %s <vab or vh> [vb]\n", argv[0]);
+		return 0;
+	}
+
+	FILE *vh = fopen(argv[1], "rb");
+	if (!vh) {
+		printf("Could not open '%s' for reading\n", argv[1]);
+		return 1;
+	}
+
+	// Without a separate VB, the body follows the header in the same file
+	FILE *vb = vh;
+	if (argc > 2) {
+		vb = fopen(argv[2], "rb");
+		if (!vb) {
+			printf("Could not open '%s' for reading\n", argv[2]);
+			fclose(vh);
+			return 1;
+		}
+	}
+
+	bool result = extractAllSamples(vh, vb);
+
+	if (vb != vh)
+		fclose(vb);
+	fclose(vh);
+
+	if (!result)
+		return 1;
+
+	printf("All Done!\n");
+	return 0;
+}